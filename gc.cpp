@@ -1,6 +1,19 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <cstring>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <fstream>
 #include <iostream>
+#include <map>
 #include <queue>
+#include <unordered_map>
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include "gc.hpp"
 
 Runtime* RUNTIME;
@@ -120,9 +133,87 @@ tryAllocateResp tryAllocateInAlloc(HeapPage *heapPage, HeapAlloc *alloc, Type *t
     return resp;
 }
 
+// sweeps a single page in place: every allocation not stained with liveColour is freed
+// and runs of adjacent free allocations are merged, so that the free hints of the page stay valid
+// returns whether any live allocation remains on the page
+bool sweepPage(HeapPage *page, Colour liveColour) {
+    HeapAlloc *firstFreeAlloc = nullptr;
+    HeapAlloc *freeRun = nullptr;
+    bool hasLiveAllocs = false;
+
+    auto *alloc = getNextAlloc(page);
+    while (alloc) {
+        auto *nextAlloc = getNextAlloc(page, alloc);    // must be computed before merging
+
+        if (alloc->type && alloc->colour != liveColour) alloc->type = nullptr;
+
+        if (alloc->type) {
+            hasLiveAllocs = true;
+            freeRun = nullptr;
+        } else if (freeRun) {
+            freeRun->usableWords += HEAP_ALLOC_HEADER_WORDS + alloc->usableWords;
+        } else {
+            freeRun = alloc;
+            if (!firstFreeAlloc) firstFreeAlloc = alloc;
+        }
+
+        alloc = nextAlloc;
+    }
+
+    // freeRun is the last free allocation of the page if it reaches the end of the page
+    page->lastFreeAlloc = freeRun;
+    page->middleFreeAlloc = firstFreeAlloc != freeRun ? firstFreeAlloc : nullptr;
+
+    return hasLiveAllocs;
+}
+
+// moves the page from 'unswept' to 'being swept', succeeds for exactly one caller per cycle
+inline bool claimPageSweep(HeapPage *page, uintptr_t sweepGeneration) {
+    auto expected = sweepGeneration - 2;
+    return std::atomic_ref<uintptr_t>(page->sweepGeneration).compare_exchange_strong(expected, sweepGeneration - 1);
+}
+
+inline void releasePageSweep(HeapPage *page, uintptr_t sweepGeneration) {
+    std::atomic_ref<uintptr_t>(page->sweepGeneration).store(sweepGeneration, std::memory_order_release);
+}
+
+// makes sure the page has been swept in the current cycle, sweeping it here if nobody else has done it yet
+// this is how the mutators sweep on demand if they get to a page before the background sweeper
+void ensurePageSwept(HeapPage *page) {
+    uintptr_t sweepGeneration = RUNTIME->gc->sweepGeneration;
+    std::atomic_ref<uintptr_t> pageSweepGeneration(page->sweepGeneration);
+
+    if (pageSweepGeneration.load(std::memory_order_acquire) == sweepGeneration) return;
+
+    if (claimPageSweep(page, sweepGeneration)) {
+        sweepPage(page, RUNTIME->gc->colour);
+        releasePageSweep(page, sweepGeneration);
+        return;
+    }
+
+    // somebody else is sweeping the page right now
+    while (pageSweepGeneration.load(std::memory_order_acquire) != sweepGeneration) std::this_thread::yield();
+}
+
+// gives up on sweeping the page in the current cycle, unless that is under way already
+// the page a thread allocates into can only be swept by that thread, it could be carving an allocation out of it
+// at any time; its garbage is then kept until the page gets swept in a later cycle, it keeps an old colour meanwhile
+void skipPageSweep(HeapPage *page) {
+    uintptr_t sweepGeneration = RUNTIME->gc->sweepGeneration;
+    std::atomic_ref<uintptr_t> pageSweepGeneration(page->sweepGeneration);
+
+    auto expected = sweepGeneration - 2;
+    if (pageSweepGeneration.compare_exchange_strong(expected, sweepGeneration)) return;
+
+    // the owner is sweeping the page right now
+    while (pageSweepGeneration.load(std::memory_order_acquire) != sweepGeneration) std::this_thread::yield();
+}
+
 void* tryAllocate(HeapPage *heapPage, Type *type, bool allowSpecialPurpose = false) {
     auto requiredAllocWords = type->requiredWords;
 
+    ensurePageSwept(heapPage);
+
     // if the page is a single-purpose page, or it isn't, but it's too small, skip it
     if ((heapPage->isSinglePurpose && !allowSpecialPurpose) || heapPage->usableWords - HEAP_ALLOC_HEADER_WORDS < requiredAllocWords) {
         return nullptr;
@@ -151,28 +242,302 @@ void* tryAllocate(HeapPage *heapPage, Type *type, bool allowSpecialPurpose = fal
     return nullptr;
 }
 
-HeapPage *createNewHeapPage(size_t minUsablePageWords = HEAP_PAGE_SIZE_WORDS) {
+// parses a kernel cpu/node list such as "0-3,8-11" and calls fn for every entry
+template<typename Fn>
+void forEachInKernelList(const std::string &list, Fn fn) {
+    size_t pos = 0;
+    while (pos < list.size()) {
+        auto end = list.find(',', pos);
+        if (end == std::string::npos) end = list.size();
+        auto range = list.substr(pos, end - pos);
+        auto dash = range.find('-');
+        if (!range.empty()) {
+            auto first = std::stoul(range);
+            auto last = dash == std::string::npos ? first : std::stoul(range.substr(dash + 1));
+            for (auto i = first; i <= last; i++) fn(i);
+        }
+        pos = end + 1;
+    }
+}
+
+// discovers the NUMA topology from sysfs, anything unexpected makes it fall back to a single node holding all CPUs
+void initNuma(GC *gc) {
+    std::string onlineNodes;
+    std::getline(std::ifstream("/sys/devices/system/node/online"), onlineNodes);
+
+    unsigned long nodeCount = 0;
+    forEachInKernelList(onlineNodes, [&](unsigned long node) { nodeCount = std::max(nodeCount, node + 1); });
+    if (nodeCount == 0 || nodeCount > MAX_NUMA_NODES) nodeCount = 1;
+
+    gc->numaNodeCount = nodeCount;
+    gc->numaNodeCpus = new cpu_set_t[nodeCount];
+    gc->pagePools = new PagePool[nodeCount];
+
+    if (nodeCount == 1) {
+        CPU_ZERO(&gc->numaNodeCpus[0]);
+        sched_getaffinity(0, sizeof(cpu_set_t), &gc->numaNodeCpus[0]);
+        return;
+    }
+
+    for (unsigned long node = 0; node < nodeCount; node++) {
+        CPU_ZERO(&gc->numaNodeCpus[node]);
+        std::string cpus;
+        std::getline(std::ifstream("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"), cpus);
+        forEachInKernelList(cpus, [&](unsigned long cpu) { if (cpu < CPU_SETSIZE) CPU_SET(cpu, &gc->numaNodeCpus[node]); });
+    }
+}
+
+unsigned short currentNumaNode() {
+    auto cpu = sched_getcpu();
+    if (cpu < 0) return 0;
+
+    for (unsigned short node = 0; node < RUNTIME->gc->numaNodeCount; node++) {
+        if (CPU_ISSET(cpu, &RUNTIME->gc->numaNodeCpus[node])) return node;
+    }
+
+    return 0;
+}
+
+// restricts the calling thread to the CPUs of the node
+void pinToNumaNode(unsigned short numaNode) {
+    if (RUNTIME->gc->numaNodeCount == 1) return;
+    sched_setaffinity(0, sizeof(cpu_set_t), &RUNTIME->gc->numaNodeCpus[numaNode]);
+}
+
+// pins the calling thread to the node and makes the allocator of the thread take its new heap pages from there
+// pages the thread already holds stay where they are
+void bindThreadToNumaNode(ThreadRuntime *thread, unsigned short numaNode) {
+    if (numaNode >= RUNTIME->gc->numaNodeCount) numaNode = 0;
+    pinToNumaNode(numaNode);
+    thread->allocator.numaNode = numaNode;
+}
+
+const size_t OS_PAGE_BYTES = sysconf(_SC_PAGESIZE);
+
+size_t getPageBytes(size_t usableWords) {
+    return (HEAP_PAGE_HEADER_WORDS + usableWords) * sizeof(uintptr_t);
+}
+
+// the first OS page of a heap page holds its header and is never released
+size_t getReleasableBytes(HeapPage *page) {
+    return getPageBytes(page->usableWords) - OS_PAGE_BYTES;
+}
+
+void requestGC() {
+    {
+        std::lock_guard<std::mutex> lock(RUNTIME->gc->gcRequestMutex);
+        RUNTIME->gc->isGCRequested = true;
+    }
+    RUNTIME->gc->gcRequestCondition.notify_one();
+}
+
+// accounts for heap memory about to be used, fails if that would cross the hard limit
+// crossing the soft limit only wakes the GC thread up
+bool reserveHeapBytes(size_t bytes) {
+    auto heapBytes = RUNTIME->gc->heapBytes.fetch_add(bytes) + bytes;
+
+    auto hardLimit = RUNTIME->gc->heapHardLimitBytes;
+    if (hardLimit && heapBytes > hardLimit) {
+        RUNTIME->gc->heapBytes.fetch_sub(bytes);
+        return false;
+    }
+
+    auto softLimit = RUNTIME->gc->heapSoftLimitBytes;
+    if (softLimit && heapBytes > softLimit) requestGC();
+
+    return true;
+}
+
+void releaseHeapBytes(size_t bytes) {
+    RUNTIME->gc->heapBytes.fetch_sub(bytes);
+}
+
+size_t roundUpToOsPages(size_t bytes) {
+    return (bytes + OS_PAGE_BYTES - 1) / OS_PAGE_BYTES * OS_PAGE_BYTES;
+}
+
+#ifdef HLLR_COMPRESSED_REFS
+uintptr_t COMPRESSED_HEAP_BASE;
+
+// reserves the address space all heap pages are placed in, nothing is committed until a page is mapped there
+void initCompressedHeap(GC *gc) {
+    auto *memory = mmap(nullptr, COMPRESSED_HEAP_BYTES, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED) {
+        std::cerr << "Failed to reserve the compressed heap region!" << std::endl;
+        exit(1);
+    }
+
+    COMPRESSED_HEAP_BASE = (uintptr_t) memory;
+    gc->heapRegionUsedBytes = OS_PAGE_BYTES;    // keeps offset 0 free for the null reference
+}
+
+// first fit among the ranges given back so far, otherwise the range is taken from the never used end of the region
+void *takeHeapRegionRange(size_t bytes) {
+    std::lock_guard<std::mutex> lock(RUNTIME->gc->heapRegionMutex);
+    auto &freeRanges = RUNTIME->gc->heapRegionFreeRanges;
+
+    for (auto it = freeRanges.begin(); it != freeRanges.end(); ++it) {
+        if (it->second < bytes) continue;
+
+        auto [start, rangeBytes] = *it;
+        freeRanges.erase(it);
+        if (rangeBytes > bytes) freeRanges.emplace(start + bytes, rangeBytes - bytes);
+        return (void*) start;
+    }
+
+    if (RUNTIME->gc->heapRegionUsedBytes + bytes > COMPRESSED_HEAP_BYTES) return nullptr;
+
+    auto start = COMPRESSED_HEAP_BASE + RUNTIME->gc->heapRegionUsedBytes;
+    RUNTIME->gc->heapRegionUsedBytes += bytes;
+    return (void*) start;
+}
+
+// adjacent free ranges are merged so that big single-purpose pages can reuse them
+void returnHeapRegionRange(void *memory, size_t bytes) {
+    std::lock_guard<std::mutex> lock(RUNTIME->gc->heapRegionMutex);
+    auto &freeRanges = RUNTIME->gc->heapRegionFreeRanges;
+
+    auto start = (uintptr_t) memory;
+
+    auto next = freeRanges.lower_bound(start);
+    if (next != freeRanges.end() && start + bytes == next->first) {
+        bytes += next->second;
+        next = freeRanges.erase(next);
+    }
+
+    if (next != freeRanges.begin()) {
+        auto previous = std::prev(next);
+        if (previous->first + previous->second == start) {
+            previous->second += bytes;
+            return;
+        }
+    }
+
+    freeRanges.emplace(start, bytes);
+}
+#endif
+
+// maps fresh memory for a heap page, preferably backed by the given node
+HeapPage *allocatePageMemory(size_t usableWords, unsigned short numaNode) {
+    auto pageBytes = getPageBytes(usableWords);
+    if (!reserveHeapBytes(pageBytes)) return nullptr;
+
+#ifdef HLLR_COMPRESSED_REFS
+    // the page must lie in the reserved region for references to it to fit into 32 bits
+    auto *memory = takeHeapRegionRange(roundUpToOsPages(pageBytes));
+    if (memory && mmap(memory, pageBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        returnHeapRegionRange(memory, roundUpToOsPages(pageBytes));
+        memory = nullptr;
+    }
+#else
+    auto *memory = mmap(nullptr, pageBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) memory = nullptr;
+#endif
+
+    if (!memory) {
+        releaseHeapBytes(pageBytes);
+        return nullptr;
+    }
+
+    if (RUNTIME->gc->numaNodeCount > 1) {
+        // nothing is touched yet, so the policy applies to every physical page backing the heap page
+        unsigned long nodeMask = 1ul << numaNode;
+        syscall(SYS_mbind, memory, pageBytes, MPOL_PREFERRED, &nodeMask, MAX_NUMA_NODES + 1, 0);
+    }
+
+    ((HeapPage*) memory)->isReleased = false;
+    return (HeapPage*) memory;
+}
+
+void freePageMemory(HeapPage *page) {
+    auto pageBytes = getPageBytes(page->usableWords);
+    releaseHeapBytes(page->isReleased ? pageBytes - getReleasableBytes(page) : pageBytes);
+
+#ifdef HLLR_COMPRESSED_REFS
+    // the range stays reserved, but not committed, until another page is placed there
+    mmap(page, pageBytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+    returnHeapRegionRange(page, roundUpToOsPages(pageBytes));
+#else
+    munmap(page, pageBytes);
+#endif
+}
+
+// gives the memory of a pooled page back to the OS, it is zero-filled on demand once the page is reused
+void releasePageMemory(HeapPage *page) {
+    madvise((void*) ((uintptr_t) page + OS_PAGE_BYTES), getReleasableBytes(page), MADV_DONTNEED);
+    page->isReleased = true;
+    releaseHeapBytes(getReleasableBytes(page));
+}
+
+// takes back the memory of a released page, fails if that would cross the hard limit
+bool reacquirePageMemory(HeapPage *page) {
+    if (!page->isReleased) return true;
+    if (!reserveHeapBytes(getReleasableBytes(page))) return false;
+    page->isReleased = false;
+    return true;
+}
+
+// releases the memory of pooled pages to the OS, the pages themselves stay in the pools
+// pages that have been idle in a pool for SCAVENGE_IDLE_CYCLES cycles are always released,
+// the recently pooled ones only as long as the heap stays above targetBytes
+// (while pooled, HeapPage::sweepGeneration still tells which cycle the page was recycled in)
+void scavengeHeapPages(size_t targetBytes) {
+    uintptr_t sweepGeneration = RUNTIME->gc->sweepGeneration;
+
+    for (unsigned short node = 0; node < RUNTIME->gc->numaNodeCount; node++) {
+        auto &pool = RUNTIME->gc->pagePools[node];
+        std::lock_guard<std::mutex> lock(pool.mutex);
+
+        auto scavengePages = [sweepGeneration, targetBytes](HeapPage *firstPage) {
+            for (auto *page = firstPage; page; page = page->nextPage) {
+                if (page->isReleased) continue;
+
+                bool isIdle = page->sweepGeneration + 2 * SCAVENGE_IDLE_CYCLES < sweepGeneration;
+                bool isAboveTarget = RUNTIME->gc->heapBytes > targetBytes;
+
+                if (isIdle || isAboveTarget) releasePageMemory(page);
+            }
+        };
+
+        scavengePages(pool.freePages);
+        for (auto *firstPage : pool.freeBufferPages) scavengePages(firstPage);
+    }
+}
+
+HeapPage *createNewHeapPage(unsigned short numaNode, size_t minUsablePageWords = HEAP_PAGE_SIZE_WORDS, bool isSinglePurpose = false) {
 //    std::cout << "New heap page!" << std::endl;
     // not enough space in any of the pages
     // create new page
     auto pageUsableWords = HEAP_PAGE_SIZE_WORDS;
-    auto isSinglePurpose = false;
-    if (minUsablePageWords > HEAP_PAGE_SIZE_WORDS) {
+    if (minUsablePageWords > HEAP_PAGE_SIZE_WORDS || isSinglePurpose) {
         pageUsableWords = minUsablePageWords;
         isSinglePurpose = true;
     }
 
-    auto *newPage = (HeapPage *) new(std::nothrow) uintptr_t[HEAP_PAGE_HEADER_WORDS + pageUsableWords];
+    HeapPage *newPage = nullptr;
 
-    if (!newPage) {
-        // FIXME: OutOfMemoryError
-        printf("OOME!\n");
-        exit(15);
+    if (!isSinglePurpose) {
+        // prefer pages recycled by the sweeper over fresh memory, as long as they are local
+        auto &pool = RUNTIME->gc->pagePools[numaNode];
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        newPage = pool.freePages;
+        if (newPage && !reacquirePageMemory(newPage)) return nullptr;
+        if (newPage) pool.freePages = newPage->nextPage;
     }
 
+    if (!newPage) newPage = allocatePageMemory(pageUsableWords, numaNode);
+
+    // out of memory, the caller decides whether to collect and retry
+    if (!newPage) return nullptr;
+
     newPage->nextPage = nullptr;
     newPage->usableWords = pageUsableWords;
+    newPage->sweepGeneration = RUNTIME->gc->sweepGeneration;
+    newPage->numaNode = numaNode;
     newPage->isSinglePurpose = isSinglePurpose;
+    newPage->isImage = false;
+    newPage->isBufferPage = false;
+    newPage->colour = RUNTIME->gc->colour;
 
     auto *newPageAlloc = getNextAlloc(newPage);
     newPageAlloc->usableWords = pageUsableWords - HEAP_ALLOC_HEADER_WORDS;
@@ -185,11 +550,26 @@ HeapPage *createNewHeapPage(size_t minUsablePageWords = HEAP_PAGE_SIZE_WORDS) {
     return newPage;
 }
 
+void gcEmergency();
+
+// like createNewHeapPage, but runs an emergency collection before giving up
+HeapPage *createNewHeapPageOrCollect(unsigned short numaNode, size_t minUsablePageWords = HEAP_PAGE_SIZE_WORDS, bool isSinglePurpose = false) {
+    auto *newPage = createNewHeapPage(numaNode, minUsablePageWords, isSinglePurpose);
+    if (newPage) return newPage;
+
+    gcEmergency();
+
+    newPage = createNewHeapPage(numaNode, minUsablePageWords, isSinglePurpose);
+    if (!newPage) throw OutOfMemoryError();
+
+    return newPage;
+}
+
 void *Allocator::alloc(Type *type, size_t idx) {
     void* dataPtr = tryAllocate(lastPage, type);
 
     if (!dataPtr) {
-        auto *newPage = createNewHeapPage(HEAP_ALLOC_HEADER_WORDS + type->requiredWords);
+        auto *newPage = createNewHeapPageOrCollect(numaNode, HEAP_ALLOC_HEADER_WORDS + type->requiredWords);
         dataPtr = tryAllocate(newPage, type, true);
 
         if (!dataPtr) {
@@ -205,11 +585,157 @@ void *Allocator::alloc(Type *type, size_t idx) {
         lastPage = newPage;
     }
 
-    this->pointerStack[idx] = (uintptr_t) dataPtr;
+    return this->publish(type, dataPtr, type->requiredWords * sizeof(uintptr_t), idx);
+}
+
+// makes a freshly allocated object a GC root
+void *Allocator::publish(Type *type, void *dataPtr, size_t bytes, size_t idx) {
+    // the GC may have flipped the colour while we were allocating, the object would then carry the old colour
+    // and be swept although it is reachable, so it gets re-stained once it is published on the pointer stack;
+    // the store and the load are both seq_cst, like the flip in gcStartMarking and the loads of the stack scans,
+    // so either the scan finds the object or the object gets the new colour (store-load order is not a given otherwise)
+    std::atomic_ref<HeapRef>(this->pointerStack[idx]).store(encodeRef(dataPtr));
+
+    // the page is stained too, every allocation goes through here, so a page with nothing marked or allocated
+    // in the current cycle is known to be dead without looking at its allocations, see gcSweepWorker
+    auto *alloc = (HeapAlloc*) ((uintptr_t) dataPtr - HEAP_ALLOC_HEADER_BYTES);
+    alloc->colour = RUNTIME->gc->colour;
+    alloc->parentPage->colour = alloc->colour;
+
+    // this is all the sampling profiler and incremental marking cost while they are off
+    this->bytesUntilSlowPath -= (intptr_t) bytes;
+    if (this->bytesUntilSlowPath <= 0) [[unlikely]] this->runSlowPath(type, dataPtr, bytes);
 
     return dataPtr;
 }
 
+Type BUFFER_TYPE {
+        .requiredWords = 0,                 // the actual size is the size of the allocation
+        .pointersCount = 0,
+        .name = "Buffer",
+};
+
+// buffer sizes are rounded up to a power of two of OS pages, so that dead buffer pages can be recycled by size class
+size_t getBufferSizeClass(size_t bufferBytes) {
+    size_t sizeClass = 0;
+    while ((OS_PAGE_BYTES << sizeClass) < bufferBytes) sizeClass++;
+    return sizeClass;
+}
+
+// the buffer starts right after the first OS page of its page, see allocBuffer
+size_t getBufferPageBufferBytes(HeapPage *page) {
+    return (HEAP_PAGE_HEADER_WORDS + page->usableWords) * sizeof(uintptr_t) - OS_PAGE_BYTES;
+}
+
+HeapPage *takePooledBufferPage(unsigned short numaNode, size_t sizeClass) {
+    auto &pool = RUNTIME->gc->pagePools[numaNode];
+    std::lock_guard<std::mutex> lock(pool.mutex);
+
+    auto *page = pool.freeBufferPages[sizeClass];
+    if (page && !reacquirePageMemory(page)) return nullptr;
+    if (page) pool.freeBufferPages[sizeClass] = page->nextPage;
+    return page;
+}
+
+// a buffer gets a single-purpose page laid out so that its data starts on the second OS page:
+// the page header, then a free allocation as padding, then the buffer allocation header, then the data
+// the page is recycled for buffers of the same size class once the buffer is dead, the first OS page only ever
+// holds the headers, so a page taken from the pool costs no system call and no zeroing
+void *Allocator::allocBuffer(size_t bytes, size_t idx) {
+    auto sizeClass = getBufferSizeClass(std::max<size_t>(bytes, 1));
+    auto isPooled = sizeClass < BUFFER_SIZE_CLASSES;
+
+    auto bufferWords = (isPooled ? OS_PAGE_BYTES << sizeClass : roundUpToOsPages(bytes)) / sizeof(uintptr_t);
+    auto paddingWords = OS_PAGE_BYTES / sizeof(uintptr_t) - HEAP_PAGE_HEADER_WORDS - 2 * HEAP_ALLOC_HEADER_WORDS;
+
+    auto *page = isPooled ? takePooledBufferPage(numaNode, sizeClass) : nullptr;
+    if (page) {
+        page->nextPage = nullptr;
+        page->sweepGeneration = RUNTIME->gc->sweepGeneration;
+        page->colour = RUNTIME->gc->colour;
+    } else {
+        page = createNewHeapPageOrCollect(numaNode, HEAP_ALLOC_HEADER_WORDS + paddingWords + HEAP_ALLOC_HEADER_WORDS + bufferWords, true);
+        page->isBufferPage = true;
+    }
+
+    auto *paddingAlloc = getNextAlloc(page);
+    paddingAlloc->type = nullptr;
+    paddingAlloc->usableWords = paddingWords;
+
+    auto *bufferAlloc = getNextAlloc(page, paddingAlloc);
+    bufferAlloc->type = &BUFFER_TYPE;
+    bufferAlloc->usableWords = bufferWords;
+    bufferAlloc->parentPage = page;
+    bufferAlloc->colour = RUNTIME->gc->colour;
+
+    // nothing else is ever allocated on the page, and the data is left as the OS (or the I/O) wrote it
+    page->lastFreeAlloc = nullptr;
+    page->middleFreeAlloc = nullptr;
+
+    if (lastBufferPage) {
+        lastBufferPage->nextPage = page;
+    } else {
+        firstBufferPage = page;
+    }
+    lastBufferPage = page;
+
+    return this->publish(&BUFFER_TYPE, getDataPtr(bufferAlloc), bufferWords * sizeof(uintptr_t), idx);
+}
+
+// draws the number of bytes to be allocated until the next sample, exponentially distributed with mean sampleRateBytes
+// so that the samples form a poisson process over the allocated bytes and every byte is equally likely to be sampled
+intptr_t drawSampleDistance(uint64_t &randomState, size_t sampleRateBytes) {
+    if (sampleRateBytes == 0) return INTPTR_MAX;
+
+    // xorshift64*
+    randomState ^= randomState >> 12;
+    randomState ^= randomState << 25;
+    randomState ^= randomState >> 27;
+    auto random = randomState * 0x2545F4914F6CDD1DULL;
+
+    double uniform = (double) ((random >> 11) + 1) / (double) (1ull << 53);    // in (0, 1]
+    return (intptr_t) (-std::log(uniform) * (double) sampleRateBytes) + 1;
+}
+
+// the bytes allocated since bytesUntilSlowPath was set are taken off the distances of the sample and the mark slice
+void Allocator::settleSlowPath() {
+    auto allocatedBytes = this->slowPathDistance - this->bytesUntilSlowPath;
+    this->bytesUntilSample -= allocatedBytes;
+    this->bytesUntilMarkSlice -= allocatedBytes;
+    this->slowPathDistance = this->bytesUntilSlowPath;
+}
+
+// the slow path of publish is taken by the allocation that makes the nearer of the two due
+void Allocator::armSlowPath() {
+    this->slowPathDistance = std::min(this->bytesUntilSample, this->bytesUntilMarkSlice);
+    this->bytesUntilSlowPath = this->slowPathDistance;
+}
+
+// the slow path of publish, samples the allocation and/or runs an incremental marking slice, whichever is due
+void Allocator::runSlowPath(Type *type, void *dataPtr, size_t bytes) {
+    this->settleSlowPath();
+
+    // sampling is left out if it has been switched off since the distance was drawn
+    auto sampleRateBytes = RUNTIME->gc->allocationSampleRateBytes;
+    if (this->bytesUntilSample <= 0 && sampleRateBytes) {
+        AllocationSample sample {
+                .type = type,
+                .bytes = bytes,
+                .dataPtr = dataPtr,
+                .survivedCollections = 0,
+        };
+        sample.backtraceDepth = backtrace(sample.backtrace, ALLOCATION_SAMPLE_MAX_FRAMES);
+
+        std::lock_guard<std::mutex> lock(RUNTIME->gc->allocationSamplesMutex);
+        RUNTIME->gc->allocationSamples.push_back(sample);
+    }
+    if (this->bytesUntilSample <= 0) this->bytesUntilSample = drawSampleDistance(this->sampleRandomState, sampleRateBytes);
+
+    if (this->bytesUntilMarkSlice <= 0) this->runMarkSlice();
+
+    this->armSlowPath();
+}
+
 void Allocator::dealloc(void *dataPtr) {
     if (dataPtr == nullptr) return;
     HeapAlloc *alloc = (HeapAlloc*) ((uintptr_t) dataPtr - HEAP_ALLOC_HEADER_BYTES);
@@ -217,12 +743,28 @@ void Allocator::dealloc(void *dataPtr) {
     alloc->parentPage->middleFreeAlloc = alloc;
 }
 
-void markPtrRecursive(uintptr_t dataPtr, std::queue<uintptr_t> &queue, unsigned short recursionLimit = 100) {
+// pointers found by a marking worker that point into pages of another NUMA node
+struct RemoteMarkQueue {
+    std::mutex mutex;                       // mutex to coordinate pushing from the workers of other nodes
+    std::vector<uintptr_t> pointers;        // pointers to be marked by a worker of the node
+};
+
+struct MarkState {
+    std::queue<uintptr_t> queue;            // pointers left over after hitting the recursion limit
+    unsigned short numaNode = 0;            // NUMA node of the marking worker
+    RemoteMarkQueue *remoteQueues = nullptr; // queue of every node, nullptr makes the worker mark everything by itself
+    std::vector<uintptr_t> weakRefs;        // weak references marked by the worker
+};
+
+void markPtrRecursive(uintptr_t dataPtr, MarkState &state, unsigned short recursionLimit = 100) {
     if (dataPtr == 0) return;
 
     HeapAlloc *alloc = (HeapAlloc*) (dataPtr - HEAP_ALLOC_HEADER_BYTES);
     if (alloc->colour == RUNTIME->gc->colour) return;
 
+    // image pages may be read-only, and their objects only reference each other anyway
+    if (alloc->parentPage->isImage) [[unlikely]] return;
+
     alloc->colour = RUNTIME->gc->colour;
     alloc->parentPage->colour = alloc->colour;
 
@@ -230,46 +772,291 @@ void markPtrRecursive(uintptr_t dataPtr, std::queue<uintptr_t> &queue, unsigned
 
     if (!type) return;
 
+    // the referent is not traced, the weak reference is processed once marking is done
+    if (type->isWeakRef) {
+        state.weakRefs.push_back(dataPtr);
+        return;
+    }
+
     auto pointersCount = type->pointersCount;
 
     for (int i = 0; i < pointersCount; i++) {
-        auto fieldDataPtr = *((uintptr_t *) dataPtr + i);
-        if (fieldDataPtr == 0) continue;
+        auto fieldRef = ((HeapRef *) dataPtr)[i];
+        if (fieldRef == 0) continue;
+
+        auto fieldDataPtr = (uintptr_t) decodeRef(fieldRef);
+
+        if (state.remoteQueues) {
+            // objects on remote pages are left to the worker of their node, unless they are marked already
+            auto *fieldAlloc = (HeapAlloc*) (fieldDataPtr - HEAP_ALLOC_HEADER_BYTES);
+            if (fieldAlloc->colour == RUNTIME->gc->colour) continue;
+
+            auto fieldNumaNode = fieldAlloc->parentPage->numaNode;
+            if (fieldNumaNode != state.numaNode) {
+                auto &remoteQueue = state.remoteQueues[fieldNumaNode];
+                std::lock_guard<std::mutex> lock(remoteQueue.mutex);
+                remoteQueue.pointers.push_back(fieldDataPtr);
+                continue;
+            }
+        }
 
         if (recursionLimit == 0) {
-            queue.push(fieldDataPtr);
+            state.queue.push(fieldDataPtr);
         } else {
-            markPtrRecursive(fieldDataPtr, queue, recursionLimit - 1);
+            markPtrRecursive(fieldDataPtr, state, recursionLimit - 1);
         }
     }
 }
 
-void gcMarkThread(ThreadRuntime *thread) {
-    std::queue<uintptr_t> pointerQueue;
+void markQueued(MarkState &state) {
+    while (!state.queue.empty()) {
+        uintptr_t dataPtr = state.queue.front();
+        markPtrRecursive(dataPtr, state);
+        state.queue.pop();
+    }
+}
+
+void flushDiscoveredWeakRefs(MarkState &state) {
+    if (state.weakRefs.empty()) return;
+
+    std::lock_guard<std::mutex> lock(RUNTIME->gc->weakRefsMutex);
+
+    auto &discoveredWeakRefs = RUNTIME->gc->discoveredWeakRefs;
+    discoveredWeakRefs.insert(discoveredWeakRefs.end(), state.weakRefs.begin(), state.weakRefs.end());
+    state.weakRefs.clear();
+}
+
+inline bool isMarked(uintptr_t dataPtr) {
+    auto *alloc = (HeapAlloc*) (dataPtr - HEAP_ALLOC_HEADER_BYTES);
+    return alloc->colour == RUNTIME->gc->colour || alloc->parentPage->isImage;
+}
+
+std::atomic<bool> IS_INCREMENTAL_MARKING = false;
+
+// objects shaded by the write barrier are taken over and marked by the next slice
+void shadeRef(void *ptr) {
+    if (!ptr || isMarked((uintptr_t) ptr)) return;
+
+    std::lock_guard<std::mutex> lock(RUNTIME->gc->writeBarrierMutex);
+    RUNTIME->gc->writeBarrierPointers.push_back((uintptr_t) ptr);
+}
+
+// a mutator taking an object out of a weak reference or weak map while a collection is under way must make sure
+// it is marked, otherwise the collection could clear or sweep it while the mutator uses it
+// must be called with the weakRefsMutex locked, along with loading the object: the weak references cannot be processed
+// (and isMarking cannot change) in between, so the object is either marked in time or already cleared
+// during incremental marking the object is only shaded, its references are left to the slices
+void markFromMutatorLocked(uintptr_t dataPtr) {
+    if (!RUNTIME->gc->isMarking || isMarked(dataPtr)) return;
+
+    if (IS_INCREMENTAL_MARKING) {
+        shadeRef((void*) dataPtr);
+        return;
+    }
+
+    MarkState state;
+    markPtrRecursive(dataPtr, state);
+    markQueued(state);
+
+    auto &discoveredWeakRefs = RUNTIME->gc->discoveredWeakRefs;
+    discoveredWeakRefs.insert(discoveredWeakRefs.end(), state.weakRefs.begin(), state.weakRefs.end());
+}
+
+void markFromMutator(uintptr_t dataPtr) {
+    std::lock_guard<std::mutex> lock(RUNTIME->gc->weakRefsMutex);
+    markFromMutatorLocked(dataPtr);
+}
+
+void gcMarkThread(ThreadRuntime *thread, RemoteMarkQueue *remoteQueues = nullptr) {
+    MarkState state { .numaNode = thread->allocator.numaNode, .remoteQueues = remoteQueues };
+
+    if (remoteQueues) pinToNumaNode(state.numaNode);
+
+    for (auto &slot : thread->allocator.pointerStack) {
+        auto ref = std::atomic_ref<HeapRef>(slot).load();
+        if (ref == 0) continue;
+        markPtrRecursive((uintptr_t) decodeRef(ref), state);
+    }
+
+    markQueued(state);
+    flushDiscoveredWeakRefs(state);
+}
+
+// marks the pointers handed over to the node by the workers of other nodes so far
+void gcMarkRemoteQueue(unsigned short numaNode, RemoteMarkQueue *remoteQueues) {
+    MarkState state { .numaNode = numaNode, .remoteQueues = remoteQueues };
+
+    pinToNumaNode(numaNode);
+
+    std::vector<uintptr_t> pointers;
+    {
+        std::lock_guard<std::mutex> lock(remoteQueues[numaNode].mutex);
+        pointers.swap(remoteQueues[numaNode].pointers);
+    }
+
+    for (auto pointer : pointers) markPtrRecursive(pointer, state);
+
+    markQueued(state);
+    flushDiscoveredWeakRefs(state);
+}
+
+// returns an unlinked dead page to the pool, or to the OS if it cannot be reused
+void recycleHeapPage(HeapPage *page) {
+    auto sizeClass = page->isBufferPage ? getBufferSizeClass(getBufferPageBufferBytes(page)) : BUFFER_SIZE_CLASSES;
+    if (sizeClass < BUFFER_SIZE_CLASSES) {
+        auto &pool = RUNTIME->gc->pagePools[page->numaNode];
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        page->nextPage = pool.freeBufferPages[sizeClass];
+        pool.freeBufferPages[sizeClass] = page;
+        return;
+    }
+
+    if (page->isSinglePurpose) {
+        freePageMemory(page);
+        return;
+    }
+
+    auto &pool = RUNTIME->gc->pagePools[page->numaNode];
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    page->nextPage = pool.freePages;
+    pool.freePages = page;
+}
+
+// a census being taken, possibly in parts that get merged
+struct HeapCensusBuilder {
+    HeapCensus census {};
+    std::unordered_map<Type*, TypeCensus> types;
+
+    // accounts for a page, the allocations stained with liveColour are live: on a swept page that is every
+    // allocation with a type, on a page whose sweep has been skipped the others are garbage not freed yet
+    void addPage(HeapPage *page, Colour liveColour) {
+        PageCensus pageCensus {
+                .page = page,
+                .usableWords = page->usableWords,
+                .liveWords = 0,
+                .freeWords = 0,
+                .largestFreeWords = 0,
+                .numaNode = page->numaNode,
+                .isSinglePurpose = page->isSinglePurpose,
+        };
+
+        size_t freeRunWords = 0;
+
+        for (auto *alloc = getNextAlloc(page); alloc; alloc = getNextAlloc(page, alloc)) {
+            auto allocWords = HEAP_ALLOC_HEADER_WORDS + alloc->usableWords;
+
+            if (!alloc->type) {
+                pageCensus.freeWords += allocWords;
+                freeRunWords += allocWords;
+                pageCensus.largestFreeWords = std::max(pageCensus.largestFreeWords, freeRunWords);
+                continue;
+            }
+
+            freeRunWords = 0;
+            if (alloc->colour != liveColour) continue;
+
+            pageCensus.liveWords += allocWords;
+
+            auto &typeCensus = types.try_emplace(alloc->type, TypeCensus {alloc->type, 0, 0}).first->second;
+            typeCensus.liveObjects += 1;
+            typeCensus.liveBytes += allocWords * sizeof(uintptr_t);
+        }
+
+        census.freeBytes += pageCensus.freeWords * sizeof(uintptr_t);
+        census.pages.push_back(pageCensus);
+    }
+
+    void merge(HeapCensusBuilder &other) {
+        census.freeBytes += other.census.freeBytes;
+        census.pages.insert(census.pages.end(), other.census.pages.begin(), other.census.pages.end());
+
+        for (auto &[type, otherTypeCensus] : other.types) {
+            auto &typeCensus = types.try_emplace(type, TypeCensus {type, 0, 0}).first->second;
+            typeCensus.liveObjects += otherTypeCensus.liveObjects;
+            typeCensus.liveBytes += otherTypeCensus.liveBytes;
+        }
+    }
+
+    HeapCensus build() {
+        census.sweepGeneration = RUNTIME->gc->sweepGeneration;
+
+        for (auto &[type, typeCensus] : types) {
+            census.liveObjects += typeCensus.liveObjects;
+            census.liveBytes += typeCensus.liveBytes;
+            census.types.push_back(typeCensus);
+        }
+
+        std::sort(census.types.begin(), census.types.end(), [](auto &a, auto &b) { return a.liveBytes > b.liveBytes; });
+        return census;
+    }
+};
+
+// pages of all threads to be swept in the current cycle, shared by all sweep workers
+struct SweepWork {
+    std::vector<HeapPage*> pages;           // pages of every thread chain up to (excluding) its end page, in chain order
+    std::vector<char> isPageDead;           // set by the worker that swept the page if nothing on it survived
+    std::atomic<size_t> cursor = 0;         // index of the next page to be handed out to a worker
+    bool isCensusEnabled = false;           // whether the workers take a census of the pages they sweep
+    std::mutex censusMutex;                 // mutex to coordinate merging the census of every worker
+    HeapCensusBuilder census;               // census of the pages swept so far
+};
+
+// sweeps pages handed out through the shared cursor until there are none left, so the work is balanced
+// at page granularity no matter how the pages are spread across the threads
+// pages are only swept in place here, unlinking happens afterwards in gcUnlinkDeadPages
+void gcSweepWorker(SweepWork *work) {
+    uintptr_t sweepGeneration = RUNTIME->gc->sweepGeneration;
+    Colour currentColour = RUNTIME->gc->colour;
+
+    HeapCensusBuilder census;
+
+    while (true) {
+        auto pageIdx = work->cursor.fetch_add(1, std::memory_order_relaxed);
+        if (pageIdx >= work->pages.size()) break;
+
+        auto *page = work->pages[pageIdx];
+
+        // the page might have been swept on demand already, in which case it is in use and must live
+        if (!claimPageSweep(page, sweepGeneration)) continue;
+
+        // marking and allocating stain the page as well, a page of another colour has nothing live on it
+        // (what looks marked there is garbage kept from an allocation page, see skipPageSweep)
+        if (page->colour != currentColour) {
+            work->isPageDead[pageIdx] = true;
+            continue;
+        }
 
-    for (auto &pointer : thread->allocator.pointerStack) {
-        if (pointer == 0) continue;
-        markPtrRecursive(pointer, pointerQueue);
+        if (sweepPage(page, currentColour)) {
+            // the page is still ours until it is released
+            if (work->isCensusEnabled) census.addPage(page, currentColour);
+            releasePageSweep(page, sweepGeneration);
+        } else {
+            // dead pages stay in the 'being swept' state until they are unlinked
+            work->isPageDead[pageIdx] = true;
+        }
     }
 
-    while (!pointerQueue.empty()) {
-        uintptr_t dataPtr = pointerQueue.front();
-        markPtrRecursive(dataPtr, pointerQueue);
-        pointerQueue.pop();
+    if (work->isCensusEnabled) {
+        std::lock_guard<std::mutex> lock(work->censusMutex);
+        work->census.merge(census);
     }
 }
 
-void gcSweepThread(ThreadRuntime *thread, HeapPage *endPage) {
-    auto *currentPage = thread->allocator.firstPage;
+// removes the pages found dead by the sweep workers from a page chain, the first pageCount pages at most;
+// the end page, which the thread was allocating into when the sweep started, is never among them,
+// it is only ever swept on demand (by the thread itself or by gcFinishSweep) so that it is never unlinked from under the allocator
+void gcUnlinkDeadPages(SweepChain chain, size_t pageCount, const char *isPageDead) {
+    auto *currentPage = *chain.firstPage;
     auto *previousPage = (HeapPage*) nullptr;
 
-    auto currentColour = RUNTIME->gc->colour;
+    uintptr_t sweepGeneration = RUNTIME->gc->sweepGeneration;
 
+    size_t pageIdx = 0;
     int freedPages = 0;
 
-    while ((currentPage != nullptr) & (currentPage != endPage)) {
+    while ((currentPage != nullptr) & (pageIdx < pageCount)) {
 
-        bool pageMustLive = currentPage->colour == currentColour;
+        bool pageMustLive = !isPageDead[pageIdx++];
 
         if (pageMustLive) {
             previousPage = currentPage;
@@ -281,19 +1068,24 @@ void gcSweepThread(ThreadRuntime *thread, HeapPage *endPage) {
         // the next page should be connected to the chain in place of the to-be-deleted page
         auto *nextPage = currentPage->nextPage;
 
-        if (currentPage == thread->allocator.firstPage) {
+        if (currentPage == *chain.firstPage) {
             // we are about to remove the first heap page
             // we can only do it as long as there are more pages
-            if (!nextPage) break;
+            if (!nextPage) {
+                // it may not have been swept, see gcSweepWorker
+                sweepPage(currentPage, RUNTIME->gc->colour);
+                releasePageSweep(currentPage, sweepGeneration);
+                break;
+            }
 
-            thread->allocator.firstPage = nextPage;
+            *chain.firstPage = nextPage;
             previousPage = nullptr;
         } else {
             // ordinary situation, lastPage is just another page in the chain
             previousPage->nextPage = nextPage;
         }
 
-        delete[] currentPage; // pages are allocated as uintptr_t[] so they need to be deallocated as arrays
+        recycleHeapPage(currentPage);
 
 //        std::cout << "Removed heap page!" << std::endl;
 
@@ -303,82 +1095,1023 @@ void gcSweepThread(ThreadRuntime *thread, HeapPage *endPage) {
     }
 }
 
-void gcST() {
-    RUNTIME->gc->gcMutex.lock();
-
-    RUNTIME->gc->colour = RUNTIME->gc->colour == Colour::Blue ? Colour::Green : Colour::Blue;
-
-    auto start = std::chrono::steady_clock::now();
-
-    auto *thread = RUNTIME->mainThread;
-    while (thread) {
-        gcMarkThread(thread);
-        thread = thread->nextRuntime;
-    }
+void gcBackgroundSweep() {
+    SweepWork work;
 
-    thread = RUNTIME->mainThread;
-    while (thread) {
-        gcSweepThread(thread, thread->allocator.lastPage);
-        thread = thread->nextRuntime;
+    std::vector<size_t> chainPageCounts;
+    for (auto &chain : RUNTIME->gc->sweepChains) {
+        auto chainStart = work.pages.size();
+        auto *page = *chain.firstPage;
+        while ((page != nullptr) & (page != chain.endPage)) {
+            work.pages.push_back(page);
+            page = page->nextPage;
+        }
+        chainPageCounts.push_back(work.pages.size() - chainStart);
     }
 
-    RUNTIME->gc->gcMutex.unlock();
-
-//    std::cout << "GC took (ms)=" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count() << std::endl;
-}
-
-void gc() {
-    RUNTIME->gc->gcMutex.lock();
+    work.isPageDead.resize(work.pages.size(), false);
+    work.isCensusEnabled = RUNTIME->gc->isHeapCensusEnabled;
 
-    RUNTIME->gc->colour = RUNTIME->gc->colour == Colour::Blue ? Colour::Green : Colour::Blue;
+    // this thread is a sweep worker too
+    size_t workerCount = std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1u), work.pages.size());
 
     std::vector<std::thread *> workerThreads;
-    workerThreads.reserve(16);
+    workerThreads.reserve(workerCount);
 
-    auto *thread = RUNTIME->mainThread;
-    while (thread) {
-        workerThreads.push_back(new std::thread(gcMarkThread, thread));
-        thread = thread->nextRuntime;
+    for (size_t i = 1; i < workerCount; i++) {
+        workerThreads.push_back(new std::thread(gcSweepWorker, &work));
     }
 
+    gcSweepWorker(&work);
+
     for (auto *workerThread : workerThreads) {
         workerThread->join();
         delete workerThread;
     }
 
-    workerThreads.clear();
-
-    thread = RUNTIME->mainThread;
-    while (thread) {
-        workerThreads.push_back(new std::thread(gcSweepThread, thread, thread->allocator.lastPage));
-        thread = thread->nextRuntime;
+    size_t firstPageIdx = 0;
+    for (size_t chainIdx = 0; chainIdx < chainPageCounts.size(); chainIdx++) {
+        gcUnlinkDeadPages(RUNTIME->gc->sweepChains[chainIdx], chainPageCounts[chainIdx], work.isPageDead.data() + firstPageIdx);
+        firstPageIdx += chainPageCounts[chainIdx];
     }
 
-    for (auto *workerThread : workerThreads) {
-        workerThread->join();
-        delete workerThread;
+    if (work.isCensusEnabled) {
+        auto *census = new HeapCensus(work.census.build());
+
+        std::lock_guard<std::mutex> lock(RUNTIME->gc->heapCensusMutex);
+        delete RUNTIME->gc->lastHeapCensus;
+        RUNTIME->gc->lastHeapCensus = census;
     }
 
-    RUNTIME->gc->gcMutex.unlock();
+    RUNTIME->gc->isSweepRunning = false;
 }
 
-void addThread() {
+// waits for the sweep of the previous cycle to complete, must be called with gcMutex held before the colour flips
+// (otherwise unswept dead allocations would suddenly look marked)
+void gcFinishSweep() {
+    if (RUNTIME->gc->sweepThread) {
+        RUNTIME->gc->sweepThread->join();
+        delete RUNTIME->gc->sweepThread;
+        RUNTIME->gc->sweepThread = nullptr;
+    }
 
+    for (auto &chain : RUNTIME->gc->sweepChains) {
+        skipPageSweep(chain.endPage);
+    }
+
+    RUNTIME->gc->sweepChains.clear();
 }
 
-void removeThread() {
+// pinned buffers are roots regardless of whether they are referenced
+void gcMarkPinnedBuffers() {
+    std::lock_guard<std::mutex> lock(RUNTIME->gc->pinnedBuffersMutex);
 
+    MarkState state;
+    for (auto &[buffer, pinCount] : RUNTIME->gc->pinnedBuffers) markPtrRecursive(buffer, state);
 }
 
-void gcThreadTask() {
+// must be called with the weakRefsMutex and the mutex of every weak map locked, once nothing is left to mark:
+// the entries with unmarked keys are removed and the weak references to unmarked objects are cleared
+void gcClearWeakReferences() {
+    for (auto *weakMap : RUNTIME->gc->weakMaps) {
+        std::erase_if(weakMap->entries, [](auto &entry) { return !isMarked(entry.first); });
+    }
+
+    auto &discoveredWeakRefs = RUNTIME->gc->discoveredWeakRefs;
+    for (auto weakRef : discoveredWeakRefs) {
+        auto &referentRef = *(HeapRef*) weakRef;
+        if (referentRef && !isMarked((uintptr_t) decodeRef(referentRef))) referentRef = 0;
+    }
+
+    discoveredWeakRefs.clear();
+    RUNTIME->gc->isMarking = false;
+}
+
+// must be called after marking and before sweeping
+// values of weak maps whose keys are marked get marked too, which may mark more keys, until nothing changes;
+// then the weak references are cleared
+void gcProcessWeakReferences() {
+    std::lock_guard<std::mutex> lock(RUNTIME->gc->weakRefsMutex);
+
+    for (auto *weakMap : RUNTIME->gc->weakMaps) weakMap->mutex.lock();
+
+    MarkState state;
+
+    bool isMarkingValues = true;
+    while (isMarkingValues) {
+        isMarkingValues = false;
+
+        for (auto *weakMap : RUNTIME->gc->weakMaps) {
+            for (auto &[key, value] : weakMap->entries) {
+                if (!isMarked(key) || isMarked(value)) continue;
+
+                markPtrRecursive(value, state);
+                markQueued(state);
+                isMarkingValues = true;
+            }
+        }
+    }
+
+    auto &discoveredWeakRefs = RUNTIME->gc->discoveredWeakRefs;
+    discoveredWeakRefs.insert(discoveredWeakRefs.end(), state.weakRefs.begin(), state.weakRefs.end());
+
+    gcClearWeakReferences();
+
+    for (auto *weakMap : RUNTIME->gc->weakMaps) weakMap->mutex.unlock();
+}
+
+// the first frame is Allocator::runSlowPath itself
+std::vector<void*> getSampleStack(const AllocationSample &sample) {
+    auto *firstFrame = sample.backtrace + std::min(sample.backtraceDepth, 1);
+    return std::vector<void*>(firstFrame, sample.backtrace + sample.backtraceDepth);
+}
+
+// must be called after marking and before sweeping, when the unmarked objects are known to be dead
+// but their memory has not been reused yet
+void gcUpdateAllocationSamples() {
+    std::lock_guard<std::mutex> lock(RUNTIME->gc->allocationSamplesMutex);
+
+    auto &deadSamples = RUNTIME->gc->deadAllocationSamples;
+
+    std::erase_if(RUNTIME->gc->allocationSamples, [&deadSamples](auto &sample) {
+        auto *alloc = (HeapAlloc*) ((uintptr_t) sample.dataPtr - HEAP_ALLOC_HEADER_BYTES);
+        if (alloc->type == sample.type && alloc->colour == RUNTIME->gc->colour) {
+            sample.survivedCollections++;
+            return false;
+        }
+
+        auto &totals = deadSamples.try_emplace(getSampleStack(sample), AllocationStackTotals {0, 0}).first->second;
+        totals.objects++;
+        totals.bytes += sample.bytes;
+        return true;
+    });
+}
+
+// marking is done, from now on every page is unswept and gets swept either by
+// the background sweeper or on demand by the allocating thread, whichever gets there first
+void gcStartSweep() {
+    gcUpdateAllocationSamples();
+
+    RUNTIME->gc->sweepGeneration = RUNTIME->gc->sweepGeneration + 2;
+
+    auto *thread = RUNTIME->mainThread;
+    while (thread) {
+        auto &allocator = thread->allocator;
+        RUNTIME->gc->sweepChains.push_back({&allocator.firstPage, allocator.lastPage});
+
+        // a chain without an end page could grow under the sweeper
+        if (allocator.lastBufferPage) RUNTIME->gc->sweepChains.push_back({&allocator.firstBufferPage, allocator.lastBufferPage});
+
+        thread = thread->nextRuntime;
+    }
+
+    RUNTIME->gc->isSweepRunning = true;
+    RUNTIME->gc->sweepThread = new std::thread(gcBackgroundSweep);
+}
+
+// flips the colour, from then on the objects not marked again are garbage
+// the store is seq_cst and comes before any stack scan, see Allocator::publish
+// the weakRefsMutex makes the mutators reading weak references see the new colour and isMarking together
+void gcStartMarking() {
+    std::lock_guard<std::mutex> lock(RUNTIME->gc->weakRefsMutex);
+
+    RUNTIME->gc->colour = (Colour) ((unsigned char) RUNTIME->gc->colour.load() + 1);
+    RUNTIME->gc->isMarking = true;
+}
+
+// progress of an incremental cycle, kept from one slice to the next
+// the pointer stacks have no barrier, so marking is only over once they (and the weak maps, whose values are
+// not traced from their keys) have been rescanned from start to end without shading anything new
+struct IncrementalMark {
+    MarkState state;                        // objects shaded and not marked yet
+    bool isRescanClean = true;              // whether the rescan under way has shaded nothing so far
+    ThreadRuntime *rescanThread = nullptr;  // thread whose pointer stack is being rescanned (nullptr once all are done)
+    size_t rescanSlot = 0;                  // next slot of its pointer stack to rescan
+    size_t rescanWeakMap = 0;               // next weak map to rescan, once the pointer stacks are done
+    size_t rescanBucket = 0;                // next bucket of that weak map to rescan
+};
+
+// objects shaded by the write barrier (or by the mutators reading weak references) are taken over by the marker
+void takeWriteBarrierPointers(IncrementalMark &mark) {
+    std::lock_guard<std::mutex> lock(RUNTIME->gc->writeBarrierMutex);
+
+    auto &writeBarrierPointers = RUNTIME->gc->writeBarrierPointers;
+    for (auto dataPtr : writeBarrierPointers) mark.state.queue.push(dataPtr);
+    if (!writeBarrierPointers.empty()) mark.isRescanClean = false;
+    writeBarrierPointers.clear();
+}
+
+// what is shaded before the rescan starts is marked before it ends, so it does not make the rescan unclean
+// pinned buffers are roots as well, but only ever a few, they are shaded at once
+void gcStartRescan(IncrementalMark &mark) {
+    takeWriteBarrierPointers(mark);
+
+    {
+        std::lock_guard<std::mutex> lock(RUNTIME->gc->pinnedBuffersMutex);
+        for (auto &[buffer, pinCount] : RUNTIME->gc->pinnedBuffers) {
+            if (!isMarked(buffer)) mark.state.queue.push(buffer);
+        }
+    }
+
+    mark.isRescanClean = true;
+    mark.rescanThread = RUNTIME->mainThread;
+    mark.rescanSlot = 0;
+    mark.rescanWeakMap = 0;
+    mark.rescanBucket = 0;
+}
+
+// every slot costs one
+void gcRescanRoots(IncrementalMark &mark, size_t &budget) {
+    while ((budget > 0) & (mark.rescanThread != nullptr)) {
+        auto &pointerStack = mark.rescanThread->allocator.pointerStack;
+        auto slotCount = std::size(pointerStack);
+
+        for (; (budget > 0) & (mark.rescanSlot < slotCount); mark.rescanSlot++, budget--) {
+            auto ref = std::atomic_ref<HeapRef>(pointerStack[mark.rescanSlot]).load();
+            if (ref == 0 || isMarked((uintptr_t) decodeRef(ref))) continue;
+
+            mark.state.queue.push((uintptr_t) decodeRef(ref));
+            mark.isRescanClean = false;
+        }
+
+        if (mark.rescanSlot < slotCount) return;
+
+        mark.rescanThread = mark.rescanThread->nextRuntime;
+        mark.rescanSlot = 0;
+    }
+}
+
+// the values of entries whose keys are marked are shaded, every bucket costs one plus its entries
+// returns whether every weak map has been rescanned
+bool gcRescanWeakMaps(IncrementalMark &mark, size_t &budget) {
+    std::lock_guard<std::mutex> lock(RUNTIME->gc->weakRefsMutex);
+    auto &weakMaps = RUNTIME->gc->weakMaps;
+
+    while ((budget > 0) & (mark.rescanWeakMap < weakMaps.size())) {
+        auto *weakMap = weakMaps[mark.rescanWeakMap];
+        std::lock_guard<std::mutex> mapLock(weakMap->mutex);
+        auto &entries = weakMap->entries;
+
+        for (; (budget > 0) & (mark.rescanBucket < entries.bucket_count()); mark.rescanBucket++) {
+            budget -= std::min(budget, 1 + entries.bucket_size(mark.rescanBucket));
+
+            for (auto entry = entries.begin(mark.rescanBucket); entry != entries.end(mark.rescanBucket); entry++) {
+                if (!isMarked(entry->first) || isMarked(entry->second)) continue;
+
+                mark.state.queue.push(entry->second);
+                mark.isRescanClean = false;
+            }
+        }
+
+        if (mark.rescanBucket < entries.bucket_count()) return false;
+
+        mark.rescanWeakMap++;
+        mark.rescanBucket = 0;
+    }
+
+    return mark.rescanWeakMap >= weakMaps.size();
+}
+
+// must be called with the gcMutex locked, once a whole rescan has shaded nothing: the weak references are
+// processed and marking is over, unless something got shaded in the meantime
+// the weak maps are checked once more under their locks, a rehash or a weak map going away during the rescan
+// may have hidden some entries from it; this and clearing the weak references do not trace anything,
+// they only take a look at every entry and every weak reference
+// returns whether marking is over
+bool gcTryFinishIncrementalMark(IncrementalMark &mark) {
+    std::lock_guard<std::mutex> lock(RUNTIME->gc->weakRefsMutex);
+    for (auto *weakMap : RUNTIME->gc->weakMaps) weakMap->mutex.lock();
+
+    auto isShaded = false;
+    for (auto *weakMap : RUNTIME->gc->weakMaps) {
+        for (auto &[key, value] : weakMap->entries) {
+            if (!isMarked(key) || isMarked(value)) continue;
+            mark.state.queue.push(value);
+            isShaded = true;
+        }
+    }
+
+    if (!isShaded) {
+        std::lock_guard<std::mutex> barrierLock(RUNTIME->gc->writeBarrierMutex);
+        isShaded = !RUNTIME->gc->writeBarrierPointers.empty();
+        if (!isShaded) IS_INCREMENTAL_MARKING = false;
+    }
+
+    if (!isShaded) {
+        auto &discoveredWeakRefs = RUNTIME->gc->discoveredWeakRefs;
+        discoveredWeakRefs.insert(discoveredWeakRefs.end(), mark.state.weakRefs.begin(), mark.state.weakRefs.end());
+        gcClearWeakReferences();
+    }
+
+    for (auto *weakMap : RUNTIME->gc->weakMaps) weakMap->mutex.unlock();
+    return !isShaded;
+}
+
+// must be called with the gcMutex locked once the background sweeper of the previous cycle is done,
+// so that finishing its sweep takes no time; the roots are left to the first slice
+void gcStartIncrementalMark() {
+    gcFinishSweep();
+
+    gcStartMarking();
+
+    RUNTIME->gc->incrementalMark = new IncrementalMark;
+    RUNTIME->gc->incrementalMarkedBytes = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(RUNTIME->gc->writeBarrierMutex);
+        RUNTIME->gc->writeBarrierPointers.clear();
+    }
+    IS_INCREMENTAL_MARKING = true;
+
+    gcStartRescan(*RUNTIME->gc->incrementalMark);
+}
+
+// must be called with the gcMutex locked, scans about budget pointers: an object costs its pointers plus one for itself,
+// the rescans of the pointer stacks and of the weak maps are charged as they go too
+// returns whether the cycle is over, the sweep has then been started
+bool gcIncrementalMarkSlice(size_t budget) {
+    auto &mark = *RUNTIME->gc->incrementalMark;
+    auto &state = mark.state;
+
+    takeWriteBarrierPointers(mark);
+
+    while (budget > 0) {
+        // without recursion an object only costs its own pointers, its references are queued rather than followed
+        if (!state.queue.empty()) {
+            auto dataPtr = state.queue.front();
+            state.queue.pop();
+
+            // objects allocated during the cycle are not counted, they are born marked
+            size_t cost = 1;
+            if (!isMarked(dataPtr)) {
+                auto *alloc = (HeapAlloc*) (dataPtr - HEAP_ALLOC_HEADER_BYTES);
+                RUNTIME->gc->incrementalMarkedBytes += (HEAP_ALLOC_HEADER_WORDS + alloc->usableWords) * sizeof(uintptr_t);
+                if (alloc->type) cost += alloc->type->pointersCount;
+            }
+
+            markPtrRecursive(dataPtr, state, 0);
+            budget -= std::min(budget, cost);
+            continue;
+        }
+
+        if (mark.rescanThread) {
+            gcRescanRoots(mark, budget);
+            continue;
+        }
+
+        if (!gcRescanWeakMaps(mark, budget)) continue;
+
+        if (mark.isRescanClean && gcTryFinishIncrementalMark(mark)) {
+            delete RUNTIME->gc->incrementalMark;
+            RUNTIME->gc->incrementalMark = nullptr;
+            RUNTIME->gc->incrementalAllocatedBytes = 0;
+
+            gcStartSweep();
+            return true;
+        }
+
+        gcStartRescan(mark);
+    }
+
+    return false;
+}
+
+// must be called with the gcMutex locked, a full collection cannot start while an incremental one is under way
+void gcFinishIncrementalMark() {
+    if (!RUNTIME->gc->incrementalMark) return;
+    while (!gcIncrementalMarkSlice(SIZE_MAX));
+}
+
+void Allocator::runMarkSlice() {
+    auto *gc = RUNTIME->gc;
+
+    gc->incrementalAllocatedBytes += (size_t) ((intptr_t) gc->incrementalSliceIntervalBytes - this->bytesUntilMarkSlice);
+    this->bytesUntilMarkSlice = gc->incrementalSliceBudget ? (intptr_t) gc->incrementalSliceIntervalBytes : INTPTR_MAX;
+
+    if (!gc->incrementalSliceBudget) return;
+
+    // another thread is running a slice (or a full collection), the next slice of this thread catches up
+    if (!gc->gcMutex.try_lock()) return;
+
+    // a cycle waits for the sweeper of the previous one rather than have this thread wait for it
+    if (!gc->incrementalMark && !gc->isSweepRunning) {
+        auto softLimit = gc->heapSoftLimitBytes;
+        auto cycleBytes = std::max(gc->incrementalMarkedBytes, HEAP_PAGE_SIZE_WORDS * sizeof(uintptr_t));
+        if (gc->incrementalAllocatedBytes >= cycleBytes || (softLimit && getHeapBytes() > softLimit)) gcStartIncrementalMark();
+    }
+
+    if (gc->incrementalMark) gcIncrementalMarkSlice(gc->incrementalSliceBudget);
+
+    gc->gcMutex.unlock();
+}
+
+void gcST() {
+    RUNTIME->gc->gcMutex.lock();
+
+    gcFinishIncrementalMark();
+    gcFinishSweep();
+
+    gcStartMarking();
+
+    auto start = std::chrono::steady_clock::now();
+
+    auto *thread = RUNTIME->mainThread;
+    while (thread) {
+        gcMarkThread(thread);
+        thread = thread->nextRuntime;
+    }
+
+    gcMarkPinnedBuffers();
+    gcProcessWeakReferences();
+    gcStartSweep();
+
+    RUNTIME->gc->gcMutex.unlock();
+
+//    std::cout << "GC took (ms)=" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count() << std::endl;
+}
+
+void gc() {
+    RUNTIME->gc->gcMutex.lock();
+
+    gcFinishIncrementalMark();
+    gcFinishSweep();
+
+    gcStartMarking();
+
+    std::vector<std::thread *> workerThreads;
+    workerThreads.reserve(16);
+
+    // with more than one node every worker runs on the node of its thread and leaves remote objects to the other nodes
+    auto numaNodeCount = RUNTIME->gc->numaNodeCount;
+    auto *remoteQueues = numaNodeCount > 1 ? new RemoteMarkQueue[numaNodeCount] : nullptr;
+
+    auto *thread = RUNTIME->mainThread;
+    while (thread) {
+        workerThreads.push_back(new std::thread(gcMarkThread, thread, remoteQueues));
+        thread = thread->nextRuntime;
+    }
+
+    for (auto *workerThread : workerThreads) {
+        workerThread->join();
+        delete workerThread;
+    }
+
+    // every round drains the remote queues filled by the previous one, until no object is handed over anymore
+    while (remoteQueues) {
+        workerThreads.clear();
+
+        for (unsigned short node = 0; node < numaNodeCount; node++) {
+            if (remoteQueues[node].pointers.empty()) continue;
+            workerThreads.push_back(new std::thread(gcMarkRemoteQueue, node, remoteQueues));
+        }
+
+        if (workerThreads.empty()) break;
+
+        for (auto *workerThread : workerThreads) {
+            workerThread->join();
+            delete workerThread;
+        }
+    }
+
+    delete[] remoteQueues;
+
+    gcMarkPinnedBuffers();
+    gcProcessWeakReferences();
+    gcStartSweep();
+
+    RUNTIME->gc->gcMutex.unlock();
+}
+
+// a full, synchronous collection for when memory runs out: the sweep is completed
+// and all pooled pages are released, so that whatever got freed can be reused right away
+void gcEmergency() {
+    gcST();
+
+    RUNTIME->gc->gcMutex.lock();
+    gcFinishSweep();
+    RUNTIME->gc->gcMutex.unlock();
+
+    scavengeHeapPages(0);
+}
+
+Type WEAK_REF_TYPE {
+        .requiredWords = 1,
+        .pointersCount = 0,
+        .name = "WeakRef",
+        .isWeakRef = true,
+};
+
+void *Allocator::allocWeakRef(void *referent, size_t idx) {
+    auto *weakRef = this->alloc(&WEAK_REF_TYPE, idx);
+
+    // allocated while marking, the weak reference is stained as marked already, so the marker never discovers it
+    std::lock_guard<std::mutex> lock(RUNTIME->gc->weakRefsMutex);
+    *(HeapRef*) weakRef = encodeRef(referent);
+    if (RUNTIME->gc->isMarking) RUNTIME->gc->discoveredWeakRefs.push_back((uintptr_t) weakRef);
+    return weakRef;
+}
+
+void *getWeakRef(void *weakRef) {
+    std::lock_guard<std::mutex> lock(RUNTIME->gc->weakRefsMutex);
+
+    auto *referent = decodeRef(*(HeapRef*) weakRef);
+    if (referent) markFromMutatorLocked((uintptr_t) referent);
+    return referent;
+}
+
+WeakMap::WeakMap() {
+    std::lock_guard<std::mutex> lock(RUNTIME->gc->weakRefsMutex);
+    RUNTIME->gc->weakMaps.push_back(this);
+}
+
+WeakMap::~WeakMap() {
+    std::lock_guard<std::mutex> lock(RUNTIME->gc->weakRefsMutex);
+    std::erase(RUNTIME->gc->weakMaps, this);
+}
+
+void WeakMap::put(void *key, void *value) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->entries[(uintptr_t) key] = (uintptr_t) value;
+}
+
+void *WeakMap::get(void *key) {
+    // same order as gcProcessWeakReferences
+    std::lock_guard<std::mutex> weakRefsLock(RUNTIME->gc->weakRefsMutex);
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    auto entry = this->entries.find((uintptr_t) key);
+    if (entry == this->entries.end()) return nullptr;
+
+    markFromMutatorLocked(entry->second);
+    return (void*) entry->second;
+}
+
+void WeakMap::remove(void *key) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->entries.erase((uintptr_t) key);
+}
+
+size_t WeakMap::size() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->entries.size();
+}
+
+size_t getBufferBytes(void *buffer) {
+    return ((HeapAlloc*) ((uintptr_t) buffer - HEAP_ALLOC_HEADER_BYTES))->usableWords * sizeof(uintptr_t);
+}
+
+void pinBuffer(void *buffer) {
+    {
+        std::lock_guard<std::mutex> lock(RUNTIME->gc->pinnedBuffersMutex);
+        RUNTIME->gc->pinnedBuffers[(uintptr_t) buffer]++;
+    }
+
+    // the pinned buffers may have been marked already in a collection under way
+    markFromMutator((uintptr_t) buffer);
+}
+
+void unpinBuffer(void *buffer) {
+    std::lock_guard<std::mutex> lock(RUNTIME->gc->pinnedBuffersMutex);
+
+    auto pinnedBuffer = RUNTIME->gc->pinnedBuffers.find((uintptr_t) buffer);
+    if (pinnedBuffer == RUNTIME->gc->pinnedBuffers.end()) return;
+    if (--pinnedBuffer->second == 0) RUNTIME->gc->pinnedBuffers.erase(pinnedBuffer);
+}
+
+void setHeapLimits(size_t softLimitBytes, size_t hardLimitBytes) {
+    RUNTIME->gc->heapSoftLimitBytes = softLimitBytes;
+    RUNTIME->gc->heapHardLimitBytes = hardLimitBytes;
+}
+
+size_t getHeapBytes() {
+    return RUNTIME->gc->heapBytes;
+}
+
+void setIncrementalMarking(size_t sliceBudgetPointers, size_t sliceIntervalBytes) {
+    RUNTIME->gc->gcMutex.lock();
+
+    if (!sliceBudgetPointers) gcFinishIncrementalMark();
+
+    RUNTIME->gc->incrementalSliceBudget = sliceBudgetPointers;
+    RUNTIME->gc->incrementalSliceIntervalBytes = sliceIntervalBytes;
+
+    RUNTIME->gc->gcMutex.unlock();
+
+    auto *thread = RUNTIME->mainThread;
+    while (thread) {
+        thread->allocator.settleSlowPath();
+        thread->allocator.bytesUntilMarkSlice = sliceBudgetPointers ? (intptr_t) sliceIntervalBytes : INTPTR_MAX;
+        thread->allocator.armSlowPath();
+        thread = thread->nextRuntime;
+    }
+}
+
+// the distance to the next sample is redrawn for every thread, so the new rate applies right away
+void setAllocationSampling(size_t sampleRateBytes) {
+    RUNTIME->gc->allocationSampleRateBytes = sampleRateBytes;
+
+    auto *thread = RUNTIME->mainThread;
+    while (thread) {
+        thread->allocator.settleSlowPath();
+        thread->allocator.bytesUntilSample = drawSampleDistance(thread->allocator.sampleRandomState, sampleRateBytes);
+        thread->allocator.armSlowPath();
+        thread = thread->nextRuntime;
+    }
+}
+
+std::vector<AllocationSample> getAllocationSamples() {
+    std::lock_guard<std::mutex> lock(RUNTIME->gc->allocationSamplesMutex);
+    return RUNTIME->gc->allocationSamples;
+}
+
+// writes the samples in the legacy heap profile format understood by pprof, aggregated by call stack
+// live objects are those that have survived every collection so far (in-use space), all samples make up the allocated space
+void dumpAllocationProfile(std::ostream &out) {
+    struct StackCounts { size_t liveObjects, liveBytes, allocObjects, allocBytes; };
+
+    std::map<std::vector<void*>, StackCounts> stacks;
+    StackCounts total {0, 0, 0, 0};
+
+    {
+        std::lock_guard<std::mutex> lock(RUNTIME->gc->allocationSamplesMutex);
+
+        for (auto &sample : RUNTIME->gc->allocationSamples) {
+            auto &counts = stacks.try_emplace(getSampleStack(sample), StackCounts {0, 0, 0, 0}).first->second;
+
+            for (auto *countsToUpdate : {&counts, &total}) {
+                countsToUpdate->allocObjects += 1;
+                countsToUpdate->allocBytes += sample.bytes;
+                countsToUpdate->liveObjects += 1;
+                countsToUpdate->liveBytes += sample.bytes;
+            }
+        }
+
+        for (auto &[stack, totals] : RUNTIME->gc->deadAllocationSamples) {
+            auto &counts = stacks.try_emplace(stack, StackCounts {0, 0, 0, 0}).first->second;
+
+            for (auto *countsToUpdate : {&counts, &total}) {
+                countsToUpdate->allocObjects += totals.objects;
+                countsToUpdate->allocBytes += totals.bytes;
+            }
+        }
+    }
+
+    out << "heap profile: " << total.liveObjects << ": " << total.liveBytes
+        << " [" << total.allocObjects << ": " << total.allocBytes << "] @ heap_v2/" << RUNTIME->gc->allocationSampleRateBytes << "\n";
+
+    for (auto &[stack, counts] : stacks) {
+        out << counts.liveObjects << ": " << counts.liveBytes << " [" << counts.allocObjects << ": " << counts.allocBytes << "] @";
+        for (auto *frame : stack) out << " 0x" << std::hex << (uintptr_t) frame << std::dec;
+        out << "\n";
+    }
+
+    // lets pprof symbolize the addresses
+    out << "\nMAPPED_LIBRARIES:\n" << std::ifstream("/proc/self/maps").rdbuf();
+}
+
+// the census after each collection is taken by the sweep workers, so it leaves out the pages that the threads
+// were allocating into, as well as the pages that the threads happened to sweep on demand
+void setHeapCensusAfterCollection(bool isEnabled) {
+    RUNTIME->gc->isHeapCensusEnabled = isEnabled;
+}
+
+HeapCensus getLastHeapCensus() {
+    std::lock_guard<std::mutex> lock(RUNTIME->gc->heapCensusMutex);
+    if (!RUNTIME->gc->lastHeapCensus) return {};
+    return *RUNTIME->gc->lastHeapCensus;
+}
+
+// takes a census of every page of every thread, an incremental collection under way is finished first,
+// so that everything live carries the colour of the last marking
+// the sweep of the pages the threads were allocating into has been skipped, their garbage still has a type
+// but not that colour
+// those pages are walked without their threads stopping, see gc.hpp
+HeapCensus takeHeapCensus() {
+    HeapCensusBuilder census;
+
+    std::lock_guard<std::mutex> lock(RUNTIME->gc->gcMutex);
+    gcFinishIncrementalMark();
+    gcFinishSweep();
+
+    Colour liveColour = RUNTIME->gc->colour;
+
+    auto *thread = RUNTIME->mainThread;
+    while (thread) {
+        for (auto *page = thread->allocator.firstPage; page; page = page->nextPage) census.addPage(page, liveColour);
+        for (auto *page = thread->allocator.firstBufferPage; page; page = page->nextPage) census.addPage(page, liveColour);
+        thread = thread->nextRuntime;
+    }
+
+    return census.build();
+}
+
+void writeJsonString(const char *string, std::ostream &out) {
+    out << '"';
+
+    for (auto *c = string; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            out << '\\' << *c;
+        } else if ((unsigned char) *c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char) *c);
+            out << escaped;
+        } else {
+            out << *c;
+        }
+    }
+
+    out << '"';
+}
+
+void dumpHeapCensus(const HeapCensus &census, std::ostream &out) {
+    out << "{\"sweepGeneration\":" << census.sweepGeneration
+        << ",\"liveObjects\":" << census.liveObjects
+        << ",\"liveBytes\":" << census.liveBytes
+        << ",\"freeBytes\":" << census.freeBytes
+        << ",\"types\":[";
+
+    for (size_t i = 0; i < census.types.size(); i++) {
+        auto &typeCensus = census.types[i];
+        out << (i ? "," : "") << "{\"type\":\"" << (void*) typeCensus.type << "\"";
+        if (typeCensus.type->name) {
+            out << ",\"name\":";
+            writeJsonString(typeCensus.type->name, out);
+        }
+        out << ",\"requiredWords\":" << typeCensus.type->requiredWords
+            << ",\"liveObjects\":" << typeCensus.liveObjects
+            << ",\"liveBytes\":" << typeCensus.liveBytes << "}";
+    }
+
+    out << "],\"pages\":[";
+
+    for (size_t i = 0; i < census.pages.size(); i++) {
+        auto &pageCensus = census.pages[i];
+        out << (i ? "," : "") << "{\"page\":\"" << (void*) pageCensus.page << "\""
+            << ",\"usableWords\":" << pageCensus.usableWords
+            << ",\"liveWords\":" << pageCensus.liveWords
+            << ",\"freeWords\":" << pageCensus.freeWords
+            << ",\"largestFreeWords\":" << pageCensus.largestFreeWords
+            << ",\"numaNode\":" << pageCensus.numaNode
+            << ",\"isSinglePurpose\":" << (pageCensus.isSinglePurpose ? "true" : "false") << "}";
+    }
+
+    out << "]}";
+}
+
+const char HEAP_IMAGE_MAGIC[8] = {'H', 'L', 'L', 'R', 'I', 'M', 'G', '1'};
+
+// the file starts with this header, followed by the root offsets and the type table, the page starts at pageOffset
+struct HeapImageHeader {
+    char magic[8];                          // HEAP_IMAGE_MAGIC
+    uint64_t refBytes;                      // sizeof(HeapRef), images of compressed and uncompressed heaps are not interchangeable
+    uint64_t pageOffset;                    // where the page starts in the file, a multiple of the OS page size
+    uint64_t pageBytes;                     // size of the page, including its header
+    uint64_t rootCount;                     // number of root offsets
+    uint64_t typeCount;                     // number of type table entries
+};
+
+// lets the loader check the types it is given against the ones the image has been saved with
+struct HeapImageType {
+    uint64_t requiredWords;
+    uint64_t pointersCount;
+};
+
+// in the file, references (and roots) are the offset in words of the referenced data from the start of the page,
+// the type of an allocation is its index in the type table and its parent page is left null
+bool saveHeapImage(const char *path, const std::vector<void*> &roots, const std::vector<Type*> &types) {
+    std::unordered_map<Type*, uintptr_t> typeIndices;
+    for (size_t i = 0; i < types.size(); i++) typeIndices[types[i]] = i;
+
+    // every reachable object gets its offset in the image, in discovery order
+    std::unordered_map<uintptr_t, uintptr_t> offsets;
+    std::vector<uintptr_t> objects;
+    size_t pageWords = HEAP_PAGE_HEADER_WORDS;
+
+    auto discover = [&](uintptr_t dataPtr) {
+        if (dataPtr == 0 || offsets.contains(dataPtr)) return;
+
+        offsets[dataPtr] = pageWords + HEAP_ALLOC_HEADER_WORDS;
+        objects.push_back(dataPtr);
+        pageWords += HEAP_ALLOC_HEADER_WORDS + ((HeapAlloc*) (dataPtr - HEAP_ALLOC_HEADER_BYTES))->usableWords;
+    };
+
+    for (auto *root : roots) discover((uintptr_t) root);
+
+    for (size_t i = 0; i < objects.size(); i++) {
+        auto *type = ((HeapAlloc*) (objects[i] - HEAP_ALLOC_HEADER_BYTES))->type;
+        if (type->isWeakRef || !typeIndices.contains(type)) return false;
+
+        for (size_t j = 0; j < type->pointersCount; j++) {
+            auto fieldRef = ((HeapRef *) objects[i])[j];
+            if (fieldRef != 0) discover((uintptr_t) decodeRef(fieldRef));
+        }
+    }
+
+    std::vector<uintptr_t> page(pageWords);
+    for (auto dataPtr : objects) {
+        auto *alloc = (HeapAlloc*) (dataPtr - HEAP_ALLOC_HEADER_BYTES);
+        auto offset = offsets[dataPtr];
+
+        auto *imageAlloc = (HeapAlloc*) &page[offset - HEAP_ALLOC_HEADER_WORDS];
+        imageAlloc->type = (Type*) typeIndices[alloc->type];
+        imageAlloc->usableWords = alloc->usableWords;
+        imageAlloc->parentPage = nullptr;
+
+        memcpy(&page[offset], (void*) dataPtr, alloc->usableWords * sizeof(uintptr_t));
+
+        auto *imageRefs = (HeapRef *) &page[offset];
+        for (size_t j = 0; j < alloc->type->pointersCount; j++) {
+            if (imageRefs[j] != 0) imageRefs[j] = (HeapRef) offsets[(uintptr_t) decodeRef(imageRefs[j])];
+        }
+    }
+
+    auto *imagePage = (HeapPage*) page.data();
+    imagePage->usableWords = pageWords - HEAP_PAGE_HEADER_WORDS;
+
+    std::vector<uint64_t> rootOffsets;
+    for (auto *root : roots) rootOffsets.push_back(root ? offsets[(uintptr_t) root] : 0);
+
+    std::vector<HeapImageType> imageTypes;
+    for (auto *type : types) imageTypes.push_back({type->requiredWords, type->pointersCount});
+
+    HeapImageHeader header {
+            .refBytes = sizeof(HeapRef),
+            .rootCount = rootOffsets.size(),
+            .typeCount = imageTypes.size(),
+    };
+    memcpy(header.magic, HEAP_IMAGE_MAGIC, sizeof(header.magic));
+    header.pageOffset = roundUpToOsPages(sizeof(header) + rootOffsets.size() * sizeof(uint64_t) + imageTypes.size() * sizeof(HeapImageType));
+    header.pageBytes = pageWords * sizeof(uintptr_t);
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write((const char*) &header, sizeof(header));
+    out.write((const char*) rootOffsets.data(), (std::streamsize) (rootOffsets.size() * sizeof(uint64_t)));
+    out.write((const char*) imageTypes.data(), (std::streamsize) (imageTypes.size() * sizeof(HeapImageType)));
+    out.seekp((std::streamoff) header.pageOffset);
+    out.write((const char*) page.data(), (std::streamsize) header.pageBytes);
+
+    return out.good();
+}
+
+// maps the page of a heap image, in the reserved region if references are compressed
+void *mapHeapImagePage(int fd, size_t pageBytes, size_t pageOffset) {
+#ifdef HLLR_COMPRESSED_REFS
+    auto *memory = takeHeapRegionRange(roundUpToOsPages(pageBytes));
+    if (!memory) return nullptr;
+
+    if (mmap(memory, pageBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, (off_t) pageOffset) == MAP_FAILED) {
+        returnHeapRegionRange(memory, roundUpToOsPages(pageBytes));
+        return nullptr;
+    }
+#else
+    auto *memory = mmap(nullptr, pageBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, (off_t) pageOffset);
+    if (memory == MAP_FAILED) return nullptr;
+#endif
+
+    return memory;
+}
+
+void unmapHeapImagePage(void *memory, size_t pageBytes) {
+#ifdef HLLR_COMPRESSED_REFS
+    mmap(memory, pageBytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+    returnHeapRegionRange(memory, roundUpToOsPages(pageBytes));
+#else
+    munmap(memory, pageBytes);
+#endif
+}
+
+HeapImage *loadHeapImage(const char *path, const std::vector<Type*> &types, bool isWritable) {
+    auto fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return nullptr;
+
+    struct stat fileStat;
+    HeapImageHeader header;
+    std::vector<uint64_t> rootOffsets;
+    std::vector<HeapImageType> imageTypes;
+
+    // the page has to be entirely in the file, mapping past its end would fault on access instead of failing here
+    auto isValid = fstat(fd, &fileStat) == 0
+            && pread(fd, &header, sizeof(header), 0) == sizeof(header)
+            && memcmp(header.magic, HEAP_IMAGE_MAGIC, sizeof(header.magic)) == 0
+            && header.refBytes == sizeof(HeapRef)
+            && header.pageOffset % OS_PAGE_BYTES == 0
+            && header.pageBytes % sizeof(uintptr_t) == 0
+            && header.pageBytes >= HEAP_PAGE_HEADER_BYTES
+            && header.pageBytes <= (uint64_t) fileStat.st_size
+            && header.pageOffset <= (uint64_t) fileStat.st_size - header.pageBytes
+            && header.rootCount <= header.pageOffset / sizeof(uint64_t)
+            && header.typeCount == types.size();
+
+    if (isValid) {
+        rootOffsets.resize(header.rootCount);
+        imageTypes.resize(header.typeCount);
+
+        auto rootBytes = (ssize_t) (rootOffsets.size() * sizeof(uint64_t));
+        auto typeBytes = (ssize_t) (imageTypes.size() * sizeof(HeapImageType));
+        isValid = pread(fd, rootOffsets.data(), rootBytes, sizeof(header)) == rootBytes
+                && pread(fd, imageTypes.data(), typeBytes, (off_t) (sizeof(header) + rootBytes)) == typeBytes;
+    }
+
+    for (size_t i = 0; isValid && i < types.size(); i++) {
+        isValid = imageTypes[i].requiredWords == types[i]->requiredWords && imageTypes[i].pointersCount == types[i]->pointersCount;
+    }
+
+    auto *page = isValid ? (HeapPage*) mapHeapImagePage(fd, header.pageBytes, header.pageOffset) : nullptr;
+    close(fd);
+    if (!page) return nullptr;
+
+    auto pageStart = (uintptr_t) page;
+    auto pageEnd = pageStart + header.pageBytes;
+    auto pageWords = header.pageBytes / sizeof(uintptr_t);
+    page->usableWords = pageWords - HEAP_PAGE_HEADER_WORDS;
+
+    // the first pass checks the layout, every allocation has to fit in the page and hold enough words for its type,
+    // the offsets of their data are remembered so that roots and references can only point at the start of an object
+    std::vector<bool> isObjectStart(pageWords);
+    for (auto *alloc = getNextAlloc(page); isValid && alloc && (uintptr_t) alloc < pageEnd; alloc = getNextAlloc(page, alloc)) {
+        auto allocOffset = ((uintptr_t) alloc - pageStart) / sizeof(uintptr_t);
+        auto typeIdx = (uintptr_t) alloc->type;
+
+        isValid = pageWords - allocOffset >= HEAP_ALLOC_HEADER_WORDS
+                && alloc->usableWords <= pageWords - allocOffset - HEAP_ALLOC_HEADER_WORDS
+                && typeIdx < types.size()
+                && !types[typeIdx]->isWeakRef
+                && alloc->usableWords >= types[typeIdx]->requiredWords
+                && alloc->usableWords >= types[typeIdx]->pointersCount;
+        if (isValid) isObjectStart[allocOffset + HEAP_ALLOC_HEADER_WORDS] = true;
+    }
+
+    auto isObjectOffset = [&](uint64_t offset) { return offset < pageWords && isObjectStart[offset]; };
+    for (size_t i = 0; isValid && i < rootOffsets.size(); i++) {
+        isValid = rootOffsets[i] == 0 || isObjectOffset(rootOffsets[i]);
+    }
+
+    // the second pass relocates types and references, every object stays where it is in the file
+    for (auto *alloc = getNextAlloc(page); isValid && alloc && (uintptr_t) alloc < pageEnd; alloc = getNextAlloc(page, alloc)) {
+        alloc->type = types[(uintptr_t) alloc->type];
+        alloc->parentPage = page;
+
+        auto *refs = (HeapRef *) getDataPtr(alloc);
+        for (size_t j = 0; isValid && j < alloc->type->pointersCount; j++) {
+            if (refs[j] == 0) continue;
+
+            isValid = isObjectOffset((uint64_t) refs[j]);
+            if (isValid) refs[j] = encodeRef((void*) (pageStart + (uintptr_t) refs[j] * sizeof(uintptr_t)));
+        }
+    }
+
+    if (!isValid) {
+        unmapHeapImagePage(page, header.pageBytes);
+        return nullptr;
+    }
+
+    page->nextPage = nullptr;
+    page->middleFreeAlloc = nullptr;
+    page->lastFreeAlloc = nullptr;
+    page->sweepGeneration = RUNTIME->gc->sweepGeneration;
+    page->numaNode = 0;
+    page->isReleased = false;
+    page->isSinglePurpose = true;
+    page->isImage = true;
+    page->colour = RUNTIME->gc->colour;
+
+    if (!isWritable) mprotect(page, header.pageBytes, PROT_READ);
+
+    auto *image = new HeapImage {
+            .page = page,
+            .mappedBytes = header.pageBytes,
+    };
+    for (auto rootOffset : rootOffsets) image->roots.push_back(rootOffset ? (void*) (pageStart + rootOffset * sizeof(uintptr_t)) : nullptr);
+
+    std::lock_guard<std::mutex> lock(RUNTIME->gc->heapImagesMutex);
+    RUNTIME->gc->heapImages.push_back(image);
+    return image;
+}
+
+void addThread() {
+
+}
+
+void removeThread() {
+
+}
+
+void gcThreadTask() {
     while (RUNTIME->mainThread->isActive) {
         auto start = std::chrono::steady_clock::now();
-        gcST();
+
+        // with incremental marking on, the mutators collect by themselves
+        if (!RUNTIME->gc->incrementalSliceBudget) gcST();
 //        std::cout << "GC took (ms)=" << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count() << std::endl;
-        timespec t1;
-        t1.tv_sec = 0;
-        t1.tv_nsec = 1000 * 1000 * 100; // always keep it less than 1s, otherwise it does not sleep
-        nanosleep(&t1, &t1);
+
+        // without a soft limit only the pages idle for a long time are released, the others are about to be reused
+        auto softLimit = RUNTIME->gc->heapSoftLimitBytes;
+        scavengeHeapPages(softLimit ? softLimit : SIZE_MAX);
+
+        // sleep until the next periodic collection, unless the soft limit is crossed in the meantime
+        std::unique_lock<std::mutex> lock(RUNTIME->gc->gcRequestMutex);
+        RUNTIME->gc->gcRequestCondition.wait_for(lock, std::chrono::milliseconds(100), [] { return RUNTIME->gc->isGCRequested; });
+        RUNTIME->gc->isGCRequested = false;
     }
 }
 
@@ -392,6 +2125,12 @@ ThreadRuntime* initRuntime() {
             .mainThread = nullptr,
     };
 
+    initNuma(RUNTIME->gc);
+
+#ifdef HLLR_COMPRESSED_REFS
+    initCompressedHeap(RUNTIME->gc);
+#endif
+
     RUNTIME->mainThread = new ThreadRuntime{
             .nextRuntime = nullptr,
             .allocator = Allocator(),
@@ -405,7 +2144,12 @@ ThreadRuntime* initRuntime() {
 }
 
 Allocator::Allocator() {
-    this->firstPage = createNewHeapPage();
+    this->numaNode = currentNumaNode();
+    this->sampleRandomState = ((uintptr_t) this ^ std::chrono::steady_clock::now().time_since_epoch().count()) | 1;
+    this->bytesUntilSample = drawSampleDistance(this->sampleRandomState, RUNTIME->gc->allocationSampleRateBytes);
+    this->bytesUntilMarkSlice = RUNTIME->gc->incrementalSliceBudget ? (intptr_t) RUNTIME->gc->incrementalSliceIntervalBytes : INTPTR_MAX;
+    this->armSlowPath();
+    this->firstPage = createNewHeapPageOrCollect(this->numaNode);
     this->lastPage = this->firstPage;
 }
 
@@ -413,15 +2157,62 @@ void shutdownRuntime() {
     RUNTIME->mainThread->isActive = false;
     RUNTIME->gc->gcThread->join();
 
+    RUNTIME->gc->gcMutex.lock();
+    gcFinishIncrementalMark();
+    gcFinishSweep();
+    RUNTIME->gc->gcMutex.unlock();
+
     auto *heapPage = RUNTIME->mainThread->allocator.firstPage;
 
     while (heapPage) {
         // FIXME this is wrong as other threads might store data here too
         auto *nextPage = heapPage->nextPage;
-        delete[] heapPage;
+        freePageMemory(heapPage);
         heapPage = nextPage;
     }
 
+    heapPage = RUNTIME->mainThread->allocator.firstBufferPage;
+
+    while (heapPage) {
+        auto *nextPage = heapPage->nextPage;
+        freePageMemory(heapPage);
+        heapPage = nextPage;
+    }
+
+    for (unsigned short node = 0; node < RUNTIME->gc->numaNodeCount; node++) {
+        auto &pool = RUNTIME->gc->pagePools[node];
+
+        for (auto *firstPage : pool.freeBufferPages) {
+            heapPage = firstPage;
+
+            while (heapPage) {
+                auto *nextPage = heapPage->nextPage;
+                freePageMemory(heapPage);
+                heapPage = nextPage;
+            }
+        }
+
+        heapPage = pool.freePages;
+
+        while (heapPage) {
+            auto *nextPage = heapPage->nextPage;
+            freePageMemory(heapPage);
+            heapPage = nextPage;
+        }
+    }
+
+    for (auto *image : RUNTIME->gc->heapImages) {
+        unmapHeapImagePage(image->page, image->mappedBytes);
+        delete image;
+    }
+
+#ifdef HLLR_COMPRESSED_REFS
+    munmap((void*) COMPRESSED_HEAP_BASE, COMPRESSED_HEAP_BYTES);
+#endif
+
+    delete RUNTIME->gc->lastHeapCensus;
+    delete[] RUNTIME->gc->pagePools;
+    delete[] RUNTIME->gc->numaNodeCpus;
     delete RUNTIME->gc->gcThread;
     delete RUNTIME->gc;
     delete RUNTIME->mainThread;
@@ -430,57 +2221,48 @@ void shutdownRuntime() {
 
 void printHeap(ThreadRuntime *thread) {
     unsigned int pageCount = 0;
-    auto *page = thread->allocator.firstPage;
 
-    while (page) {
-        std::cout << "Heap page " << pageCount << std::endl;
+    // the regular pages, then the buffer pages
+    for (auto *page : {thread->allocator.firstPage, thread->allocator.firstBufferPage}) {
+        while (page) {
+            std::cout << "Heap page " << pageCount << std::endl;
 
-        auto *alloc = getNextAlloc(page);
+            auto *alloc = getNextAlloc(page);
 
-        size_t allocationCount = 0;
+            size_t allocationCount = 0;
 
-        size_t totalPageWordsUsed = 0;
+            size_t totalPageWordsUsed = 0;
 
-        while (alloc) {
-            std::cout << "Allocation " << allocationCount << " (type=" << alloc->type << " , words=" << alloc->usableWords << ")" << std::endl;
-            allocationCount++;
+            while (alloc) {
+                std::cout << "Allocation " << allocationCount << " (type=" << alloc->type << " , words=" << alloc->usableWords << ")" << std::endl;
+                allocationCount++;
 
-            totalPageWordsUsed += (HEAP_ALLOC_HEADER_WORDS + alloc->usableWords) * (alloc->type != nullptr);
+                totalPageWordsUsed += (HEAP_ALLOC_HEADER_WORDS + alloc->usableWords) * (alloc->type != nullptr);
 
-            alloc = getNextAlloc(page, alloc);
-        }
+                alloc = getNextAlloc(page, alloc);
+            }
 
-        std::cout << "Total words used (" << totalPageWordsUsed << " / " << page->usableWords << ")" << std::endl << std::endl;
+            std::cout << "Total words used (" << totalPageWordsUsed << " / " << page->usableWords << ")" << std::endl << std::endl;
 
-        pageCount++;
-        page = page->nextPage;
+            pageCount++;
+            page = page->nextPage;
+        }
     }
 }
 
 void printHeapSummary(ThreadRuntime *thread) {
-    auto *page = thread->allocator.firstPage;
-
-    unsigned int pageCount = 0;
-    size_t allocationCount = 0;
-    size_t totalPageWordsUsed = 0;
+    HeapCensusBuilder censusBuilder;
 
-    while (page) {
+    for (auto *page = thread->allocator.firstPage; page; page = page->nextPage) censusBuilder.addPage(page, RUNTIME->gc->colour);
+    for (auto *page = thread->allocator.firstBufferPage; page; page = page->nextPage) censusBuilder.addPage(page, RUNTIME->gc->colour);
 
-        auto *alloc = getNextAlloc(page);
-
-        while (alloc) {
-
-            if (alloc->type != nullptr) {
-                allocationCount++;
+    auto census = censusBuilder.build();
 
-                totalPageWordsUsed += (HEAP_ALLOC_HEADER_WORDS + alloc->usableWords) * (alloc->type != nullptr);
-
-            }
-
-            alloc = getNextAlloc(page, alloc);
-        }
+    std::cout << "Heap pages " << census.pages.size() << ", live objects " << census.liveObjects
+              << " (bytes=" << census.liveBytes << "), free bytes " << census.freeBytes << std::endl;
 
-        pageCount++;
-        page = page->nextPage;
+    for (auto &typeCensus : census.types) {
+        std::cout << "Type " << (typeCensus.type->name ? typeCensus.type->name : "") << " (type=" << typeCensus.type
+                  << ") objects=" << typeCensus.liveObjects << " bytes=" << typeCensus.liveBytes << std::endl;
     }
 }
@@ -1,14 +1,73 @@
 #ifndef GC_GC_HPP
 #define GC_GC_HPP
 
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
 #include <cstddef>
+#include <iosfwd>
+#include <map>
 #include <mutex>
+#include <new>
+#include <sched.h>
 #include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 const size_t HEAP_PAGE_SIZE_WORDS = 128000;
+const unsigned short MAX_NUMA_NODES = 64;
+const int ALLOCATION_SAMPLE_MAX_FRAMES = 32;
+const size_t BUFFER_SIZE_CLASSES = 16;      // buffers of up to 2^15 OS pages are pooled, by powers of two
+const uintptr_t SCAVENGE_IDLE_CYCLES = 50;  // pooled pages idle for that many collections are released without a soft limit
 
-enum struct Colour: char {
+#ifdef HLLR_COMPRESSED_REFS
+// heap references are 32-bit offsets (in words) from the start of a reserved region holding every heap page,
+// which caps the heap at 32 GiB; offset 0 is never used by an object, so 0 stays the null reference
+typedef uint32_t HeapRef;
+const int COMPRESSED_REF_SHIFT = 3;
+const size_t COMPRESSED_HEAP_BYTES = ((size_t) 1 << 32) << COMPRESSED_REF_SHIFT;
+extern uintptr_t COMPRESSED_HEAP_BASE;
+
+inline HeapRef encodeRef(void *ptr) {
+    return ptr ? (HeapRef) (((uintptr_t) ptr - COMPRESSED_HEAP_BASE) >> COMPRESSED_REF_SHIFT) : 0;
+}
+
+inline void *decodeRef(HeapRef ref) {
+    return ref ? (void*) (COMPRESSED_HEAP_BASE + ((uintptr_t) ref << COMPRESSED_REF_SHIFT)) : nullptr;
+}
+#else
+typedef uintptr_t HeapRef;
+
+inline HeapRef encodeRef(void *ptr) {
+    return (HeapRef) ptr;
+}
+
+inline void *decodeRef(HeapRef ref) {
+    return (void*) ref;
+}
+#endif
+
+// pointer fields of an object are the first Type::pointersCount HeapRefs of its data
+inline void *getRefField(void *object, size_t idx) {
+    return decodeRef(((HeapRef*) object)[idx]);
+}
+
+// set while an incremental collection is marking, see setIncrementalMarking
+extern std::atomic<bool> IS_INCREMENTAL_MARKING;
+void shadeRef(void *ptr);
+
+inline void setRefField(void *object, size_t idx, void *ptr) {
+    // the write barrier of incremental marking: an object marked in an earlier slice must not hide an unmarked one
+    // the store and the load of the flag are seq_cst, so the store cannot be reordered after the load: either
+    // the flag is seen and the object is shaded, or it was not set yet and the slices will find the new value
+    std::atomic_ref<HeapRef>(((HeapRef*) object)[idx]).store(encodeRef(ptr));
+    if (IS_INCREMENTAL_MARKING.load()) [[unlikely]] shadeRef(ptr);
+}
+
+// every collection stains what it marks with a colour of its own, the one after the colour of the previous collection;
+// there are 256 of them, so garbage left unswept (see skipPageSweep) only looks marked again once they wrap around
+enum struct Colour: unsigned char {
     Green = 0, Blue = 1,
 };
 
@@ -19,10 +78,20 @@ struct Allocator;
 struct ThreadRuntime;
 struct HeapPage;
 struct HeapAlloc;
+struct PagePool;
+struct AllocationSample;
+struct AllocationStackTotals;
+struct HeapCensus;
+class WeakMap;
+struct SweepChain;
+struct HeapImage;
+struct IncrementalMark;
 
 struct Type {
     size_t requiredWords;                   // how many words are needed to allocate
-    size_t pointersCount;                   // how many pointers an object of this Type stores
+    size_t pointersCount;                   // how many pointers (HeapRefs, at the start of its data) an object of this Type stores
+    const char *name = nullptr;             // used by the heap census, may be left out
+    bool isWeakRef = false;                 // whether objects of this Type are weak references, see WEAK_REF_TYPE
 };
 
 struct Runtime {
@@ -34,14 +103,95 @@ struct Runtime {
 struct GC {
     std::mutex gcMutex;                     // mutex to coordinate garbage collection
     std::thread *gcThread;                  // thread that coordinates the garbage collection
-    volatile Colour colour;                 // colour to stain new allocations with
+    std::atomic<Colour> colour;             // colour to stain new allocations with
+    volatile uintptr_t sweepGeneration = 2; // bumped by 2 every cycle, see HeapPage::sweepGeneration
+    std::thread *sweepThread = nullptr;     // background sweeper of the last cycle (nullptr if none)
+    std::atomic<bool> isSweepRunning = false; // whether the background sweeper of the last cycle is still at work
+    std::vector<SweepChain> sweepChains;    // every page chain to be swept by the background sweeper
+    unsigned short numaNodeCount = 1;       // number of NUMA nodes, 1 if the machine is not NUMA (or it can't be told)
+    cpu_set_t *numaNodeCpus = nullptr;      // CPUs of every NUMA node, used to pin threads to a node
+    PagePool *pagePools = nullptr;          // pool of recycled heap pages of every NUMA node
+    std::atomic<size_t> heapBytes = 0;      // memory held by heap pages, in use or pooled, excluding memory released to the OS
+    size_t heapSoftLimitBytes = 0;          // above it a collection is requested and pooled pages are released (0 means no limit)
+    size_t heapHardLimitBytes = 0;          // heap pages are never created above it (0 means no limit)
+    std::mutex gcRequestMutex;              // mutex to coordinate requesting a collection
+    std::condition_variable gcRequestCondition; // wakes the GC thread up before its next periodic collection
+    bool isGCRequested = false;             // whether a collection has been requested
+    size_t allocationSampleRateBytes = 0;   // mean number of allocated bytes between two samples (0 means sampling is off)
+    std::mutex allocationSamplesMutex;      // mutex to coordinate access to the samples
+    std::vector<AllocationSample> allocationSamples; // sampled allocations that are still live
+    std::map<std::vector<void*>, AllocationStackTotals> deadAllocationSamples; // sampled allocations that have died, by call stack
+#ifdef HLLR_COMPRESSED_REFS
+    std::mutex heapRegionMutex;             // mutex to coordinate placing heap pages in the reserved region
+    size_t heapRegionUsedBytes = 0;         // the region beyond this offset has never been used
+    std::map<uintptr_t, size_t> heapRegionFreeRanges; // ranges of the region given back by freed pages, by address
+#endif
+    volatile bool isMarking = false;        // whether a collection is between the colour flip and the weak reference processing
+    std::mutex weakRefsMutex;               // mutex to coordinate access to the weak references and weak maps
+    std::vector<uintptr_t> discoveredWeakRefs; // weak references marked in the current collection
+    std::vector<WeakMap*> weakMaps;         // every weak map in existence
+    std::mutex pinnedBuffersMutex;          // mutex to coordinate pinning buffers
+    std::unordered_map<uintptr_t, size_t> pinnedBuffers; // how many times each pinned buffer is pinned
+    bool isHeapCensusEnabled = false;       // whether the sweep takes a heap census after each collection
+    std::mutex heapCensusMutex;             // mutex to coordinate access to the last census
+    HeapCensus *lastHeapCensus = nullptr;   // census taken by the sweep of the last collection (nullptr if none)
+    std::mutex heapImagesMutex;             // mutex to coordinate access to the heap images
+    std::vector<HeapImage*> heapImages;     // every heap image loaded, they stay mapped until shutdown
+    size_t incrementalSliceBudget = 0;      // most pointers scanned by an incremental slice (0 means incremental marking is off)
+    size_t incrementalSliceIntervalBytes = 0; // bytes a thread allocates between two incremental slices
+    std::atomic<size_t> incrementalAllocatedBytes = 0; // bytes allocated since the last incremental cycle ended (roughly)
+    size_t incrementalMarkedBytes = 0;      // bytes marked by the incremental cycle under way, or by the last one
+    IncrementalMark *incrementalMark = nullptr; // progress of the incremental cycle under way (nullptr if none)
+    std::mutex writeBarrierMutex;           // mutex to coordinate pushing from the write barrier
+    std::vector<uintptr_t> writeBarrierPointers; // objects shaded by the write barrier, not taken over by a slice yet
+};
+
+struct AllocationSample {
+    Type *type;                             // type of the sampled object
+    size_t bytes;                           // size of the sampled object
+    void *dataPtr;                          // the sampled object
+    size_t survivedCollections;             // how many collections the object has survived
+    int backtraceDepth;                     // number of valid frames in backtrace
+    void *backtrace[ALLOCATION_SAMPLE_MAX_FRAMES]; // return addresses of the allocating call stack
+};
+
+// dead samples are only kept as totals per call stack, so that the profile does not grow with the allocations
+struct AllocationStackTotals {
+    size_t objects;                         // number of sampled objects allocated from the stack that have died
+    size_t bytes;                           // size of these objects
+};
+
+// thrown by the allocator if the hard heap limit (or the OS) does not allow any more memory, even after a full collection
+struct OutOfMemoryError : public std::bad_alloc {
+    const char *what() const noexcept override {
+        return "hllr: out of heap memory";
+    }
+};
+
+struct SweepChain {
+    HeapPage **firstPage;                   // first page of the chain, updated if that page is unlinked
+    HeapPage *endPage;                      // page being allocated into when the sweep started, it is never unlinked
+};
+
+struct PagePool {
+    std::mutex mutex;                       // mutex to coordinate access to the pool
+    HeapPage *freePages = nullptr;          // recycled (standard-size) heap pages, chained via nextPage
+    HeapPage *freeBufferPages[BUFFER_SIZE_CLASSES] = {nullptr}; // recycled buffer pages, by size class (see allocBuffer)
 };
 
 struct Allocator {
     HeapPage *firstPage;                     // pointer to the first heap page
     HeapPage *lastPage;                     // pointer to the last heap page
     uintptr_t psUsedHeight = 0;               // keeps track of the current position in the pointer stack
-    uintptr_t pointerStack[4096] = {0};     // keeps track of stack GC roots
+    HeapRef pointerStack[4096] = {0};       // keeps track of stack GC roots
+    unsigned short numaNode = 0;            // NUMA node new heap pages are taken from
+    intptr_t bytesUntilSample = INTPTR_MAX; // the allocation that brings it to 0 or below gets sampled
+    uint64_t sampleRandomState = 0;         // xorshift state to draw the distance to the next sample from
+    HeapPage *firstBufferPage = nullptr;    // pointer to the first page holding a buffer (see allocBuffer)
+    HeapPage *lastBufferPage = nullptr;     // pointer to the last page holding a buffer
+    intptr_t bytesUntilMarkSlice = INTPTR_MAX; // the allocation that brings it to 0 or below runs an incremental marking slice
+    intptr_t bytesUntilSlowPath = INTPTR_MAX; // the nearer of the two above, the only one publish counts down
+    intptr_t slowPathDistance = INTPTR_MAX; // what bytesUntilSlowPath has last been set to
 
 public:
     explicit Allocator();
@@ -64,6 +214,14 @@ public:
             return this->allocator->alloc(type, this->stackFrameOffset + idx);
         }
 
+        void *allocWeakRef(void *referent, size_t idx) {
+            return this->allocator->allocWeakRef(referent, this->stackFrameOffset + idx);
+        }
+
+        void *allocBuffer(size_t bytes, size_t idx) {
+            return this->allocator->allocBuffer(bytes, this->stackFrameOffset + idx);
+        }
+
         void dealloc(void* ptr) {
             this->allocator->dealloc(ptr);
         }
@@ -79,7 +237,22 @@ public:
 
     void *alloc(Type *type, size_t idx);
 
+    void *allocWeakRef(void *referent, size_t idx);
+
+    void *allocBuffer(size_t bytes, size_t idx);
+
     void dealloc(void *ptr);
+
+    // to be called around changing bytesUntilSample or bytesUntilMarkSlice
+    void settleSlowPath();
+    void armSlowPath();
+
+private:
+    void *publish(Type *type, void *dataPtr, size_t bytes, size_t idx);
+
+    void runSlowPath(Type *type, void *dataPtr, size_t bytes);
+
+    void runMarkSlice();
 };
 
 struct ThreadRuntime {
@@ -93,7 +266,12 @@ struct HeapPage {
     size_t usableWords;                     // size where allocations can be placed, i.e. excluding this header, as number of words
     HeapAlloc* middleFreeAlloc;             // may point to a free allocation somewhere in the middle of the page
     HeapAlloc* lastFreeAlloc;               // may point to a free allocation on the heap (nullptr otherwise)
+    uintptr_t sweepGeneration;              // GC::sweepGeneration - 2 means unswept, - 1 being swept, equal means swept
+    unsigned short numaNode;                // NUMA node the page memory is bound to
+    bool isReleased;                        // whether the memory of the (pooled) page has been given back to the OS
     bool isSinglePurpose;                   // whether it has been allocated for one big object
+    bool isImage;                           // whether it has been mapped from a heap image, its objects are always live
+    bool isBufferPage;                      // whether it has been allocated for a buffer (see allocBuffer)
     Colour colour;                          // heap page colour for GC purposes
 };
 
@@ -120,6 +298,130 @@ void gc();
 void addThread();
 void removeThread();
 
+unsigned short currentNumaNode();
+void bindThreadToNumaNode(ThreadRuntime *thread, unsigned short numaNode);
+
+void setHeapLimits(size_t softLimitBytes, size_t hardLimitBytes);
+size_t getHeapBytes();
+
+// weak references are heap objects holding a single reference that does not keep its referent alive,
+// the collector clears it (to nullptr) once the referent is not strongly reachable anymore
+extern Type WEAK_REF_TYPE;
+
+void *getWeakRef(void *weakRef);
+
+// an off-heap map from heap objects to heap objects, with ephemeron semantics: a value is kept alive by the map
+// as long as its key is reachable from outside the map, once the key becomes unreachable the entry is removed
+class WeakMap {
+private:
+    std::mutex mutex;
+    std::unordered_map<uintptr_t, uintptr_t> entries;
+
+public:
+    WeakMap();
+    ~WeakMap();
+
+    WeakMap(const WeakMap&) = delete;
+    WeakMap &operator=(const WeakMap&) = delete;
+
+    void put(void *key, void *value);
+    void *get(void *key);
+    void remove(void *key);
+    size_t size();
+
+    friend void gcProcessWeakReferences();
+    friend bool gcRescanWeakMaps(IncrementalMark &mark, size_t &budget);
+    friend void gcClearWeakReferences();
+    friend bool gcTryFinishIncrementalMark(IncrementalMark &mark);
+};
+
+// buffers are raw byte arrays (no pointers) on pages of their own, their data is aligned to an OS page
+// and is not zeroed, a buffer may get the page of a dead one with its contents;
+// like any other object they never move and are reclaimed once unreachable,
+// unless they are pinned, which keeps them alive (e.g. while the kernel reads or writes them) even without references
+extern Type BUFFER_TYPE;
+
+size_t getBufferBytes(void *buffer);
+void pinBuffer(void *buffer);
+void unpinBuffer(void *buffer);
+
+// pins a buffer for as long as it is in scope
+class BufferPin {
+private:
+    void *buffer;
+
+public:
+    explicit BufferPin(void *buffer) : buffer(buffer) {
+        pinBuffer(buffer);
+    }
+
+    BufferPin(const BufferPin&) = delete;
+    BufferPin &operator=(const BufferPin&) = delete;
+
+    ~BufferPin() {
+        unpinBuffer(this->buffer);
+    }
+};
+
+// incremental marking runs collections on the mutators instead of the GC thread, as slices scanning about
+// sliceBudgetPointers pointers (an object costs its pointer count plus one), one every sliceIntervalBytes
+// allocated by a thread; a cycle starts once the threads have allocated as much as the last one found live,
+// or the heap crosses its soft limit
+// while it is on, reference fields must be written with setRefField; a sliceBudgetPointers of 0 turns it off
+void setIncrementalMarking(size_t sliceBudgetPointers, size_t sliceIntervalBytes = 256 * 1024);
+
+void setAllocationSampling(size_t sampleRateBytes);
+std::vector<AllocationSample> getAllocationSamples();  // the samples still live
+
+void dumpAllocationProfile(std::ostream &out);
+
+struct TypeCensus {
+    Type *type;                             // type of the objects
+    size_t liveObjects;                     // number of live objects of the type
+    size_t liveBytes;                       // bytes taken by live objects of the type, including their headers
+};
+
+struct PageCensus {
+    HeapPage *page;                         // the page this census is about
+    size_t usableWords;                     // size of the page, excluding its header
+    size_t liveWords;                       // words taken by live allocations, including their headers
+    size_t freeWords;                       // words taken by free allocations, including their headers
+    size_t largestFreeWords;                // largest free allocation, freeWords much larger than this means fragmentation
+    unsigned short numaNode;                // NUMA node the page memory is bound to
+    bool isSinglePurpose;                   // whether the page has been allocated for one big object
+};
+
+struct HeapCensus {
+    uintptr_t sweepGeneration;              // tells which collection the census has been taken after
+    size_t liveObjects;                     // number of live objects
+    size_t liveBytes;                       // bytes taken by live objects, including their headers
+    size_t freeBytes;                       // bytes on the pages available for new allocations
+    std::vector<TypeCensus> types;          // live objects per type, by live bytes (descending)
+    std::vector<PageCensus> pages;          // occupancy of every page
+};
+
+void setHeapCensusAfterCollection(bool isEnabled);
+HeapCensus getLastHeapCensus();
+// walks the pages other threads allocate into as well, while they could be carving an allocation out of them:
+// take it while the other threads are not allocating, or expect their last allocations to be miscounted
+HeapCensus takeHeapCensus();
+void dumpHeapCensus(const HeapCensus &census, std::ostream &out);
+
+// a heap image is a file holding a copy of every object reachable from a set of roots, laid out as one heap page;
+// loading it maps that page back (copy-on-write) and relocates the references and types, which is a single linear pass
+// objects of a loaded image are never marked nor swept, and not traced either: they must only reference each other,
+// which is why the page is read-only unless asked otherwise (then only non-reference fields may be written to)
+struct HeapImage {
+    HeapPage *page;                         // the page mapped from the image file
+    size_t mappedBytes;                     // size of the mapping
+    std::vector<void*> roots;               // the roots the image was saved from, in the same order
+};
+
+// types are stored by their index in the types given, the same types must be given in the same order to load the image
+// the roots must stay referenced while saving; weak references cannot be saved
+bool saveHeapImage(const char *path, const std::vector<void*> &roots, const std::vector<Type*> &types);
+HeapImage *loadHeapImage(const char *path, const std::vector<Type*> &types, bool isWritable = false);
+
 void printHeap(ThreadRuntime *thread);
 void printHeapSummary(ThreadRuntime *thread);
 
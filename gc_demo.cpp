@@ -0,0 +1,519 @@
+#include <cstdio>
+#include <filesystem>
+#include <set>
+#include <sstream>
+#include "gc.hpp"
+
+// exercises the public API of the collector, in whichever reference mode it has been built with
+// every check failing is reported, the exit code tells whether any did
+
+struct Node {
+    HeapRef nextNode;
+    HeapRef payload;
+    long value;
+};
+
+Type NodeType {
+        .requiredWords = sizeof(Node) / sizeof(uintptr_t) + (sizeof(Node) % sizeof(uintptr_t) != 0),
+        .pointersCount = 2,
+        .name = "Node",
+};
+
+Type LeafType {
+        .requiredWords = 1,
+        .pointersCount = 0,
+        .name = "Leaf",
+};
+
+int failures = 0;
+
+#define CHECK(condition) do { if (!(condition)) { printf("FAILED %s:%d %s\n", __FILE__, __LINE__, #condition); failures++; } } while (0)
+
+// builds a list of nodes in slot 0, node i holding the value i
+Node *buildList(Allocator::AllocatorRAII &raii, int length) {
+    auto *head = (Node*) raii.alloc(&NodeType, 0);
+    auto *node = head;
+
+    for (int i = 1; i < length; i++) {
+        auto *nextNode = (Node*) raii.alloc(&NodeType, 1);
+        nextNode->value = i;
+        setRefField(node, 0, nextNode);
+        node = nextNode;
+    }
+
+    return head;
+}
+
+bool isListIntact(Node *head, int length) {
+    auto *node = head;
+    for (int i = 0; i < length; i++) {
+        if (!node || node->value != i) return false;
+        node = (Node*) getRefField(node, 0);
+    }
+    return node == nullptr;
+}
+
+void demoReferences(ThreadRuntime *thread) {
+    auto raii = thread->allocator.getRAII(3);
+    auto *head = buildList(raii, 100000);
+
+    // garbage in between the nodes
+    for (int i = 0; i < 1000000; i++) raii.alloc(&LeafType, 2);
+
+    gcST();
+    gc();
+    gcST();
+
+    CHECK(isListIntact(head, 100000));
+#ifdef HLLR_COMPRESSED_REFS
+    CHECK(sizeof(HeapRef) == 4);
+    CHECK(sizeof(Node) == 16);
+#else
+    CHECK(sizeof(HeapRef) == 8);
+    CHECK(sizeof(Node) == 24);
+#endif
+    printf("references: %zu bytes each, heap holds %zu bytes\n", sizeof(HeapRef), getHeapBytes());
+}
+
+const TypeCensus *findTypeCensus(const HeapCensus &census, Type *type) {
+    for (auto &typeCensus : census.types) {
+        if (typeCensus.type == type) return &typeCensus;
+    }
+    return nullptr;
+}
+
+// the list is cut shorter every cycle, its pages always keep some live nodes, so the nodes cut off
+// can only be freed by sweeping the pages object by object
+void demoSweep(ThreadRuntime *thread) {
+    auto raii = thread->allocator.getRAII(3);
+    auto *head = (Node*) raii.alloc(&NodeType, 0);
+    auto *node = head;
+    std::set<HeapPage*> listPages;
+
+    for (int i = 1; i < 20000; i++) {
+        for (int j = 0; j < 10; j++) raii.alloc(&LeafType, 2);
+
+        auto *nextNode = (Node*) raii.alloc(&NodeType, 1);
+        nextNode->value = i;
+        setRefField(node, 0, nextNode);
+        node = nextNode;
+        listPages.insert(((HeapAlloc*) ((uintptr_t) node - HEAP_ALLOC_HEADER_BYTES))->parentPage);
+    }
+    raii.alloc(&LeafType, 1);
+
+    for (int length = 20000; length > 0; length -= 4000) {
+        node = head;
+        for (int i = 1; i < length; i++) node = (Node*) getRefField(node, 0);
+        setRefField(node, 0, nullptr);
+
+        gcST();
+        gcST();
+
+        auto census = takeHeapCensus();
+        auto *nodeCensus = findTypeCensus(census, &NodeType);
+        CHECK(nodeCensus && nodeCensus->liveObjects == (size_t) length);
+        CHECK(isListIntact(head, length));
+
+        // the garbage is all freed, but for the page being allocated into; the pages left without nodes are gone
+        for (auto &pageCensus : census.pages) {
+            if (!listPages.contains(pageCensus.page) || pageCensus.page == thread->allocator.lastPage) continue;
+            CHECK(pageCensus.liveWords > 0);
+            CHECK(pageCensus.liveWords + pageCensus.freeWords == pageCensus.usableWords);
+        }
+    }
+
+    printf("sweep: %zu pages held the list\n", listPages.size());
+}
+
+// on a machine without NUMA (or whose nodes can't be told) everything falls back to node 0, binding the thread
+// to a node that does not exist too
+void demoNuma(ThreadRuntime *thread) {
+    auto nodeCount = RUNTIME->gc->numaNodeCount;
+    CHECK(nodeCount >= 1);
+    CHECK(currentNumaNode() < nodeCount);
+
+    cpu_set_t cpusBefore, cpusAfter;
+    sched_getaffinity(0, sizeof(cpu_set_t), &cpusBefore);
+    bindThreadToNumaNode(thread, nodeCount);
+    sched_getaffinity(0, sizeof(cpu_set_t), &cpusAfter);
+
+    CHECK(thread->allocator.numaNode == 0);
+
+    auto raii = thread->allocator.getRAII(1);
+    for (int i = 0; i < 1000000; i++) raii.alloc(&LeafType, 0);
+    gcST();
+
+    if (nodeCount == 1) {
+        CHECK(currentNumaNode() == 0);
+        CHECK(CPU_EQUAL(&cpusBefore, &cpusAfter));
+
+        size_t pagesElsewhere = 0;
+        for (auto &pageCensus : takeHeapCensus().pages) pagesElsewhere += pageCensus.numaNode != 0;
+        CHECK(pagesElsewhere == 0);
+    }
+    printf("numa: %u nodes, running on node %u\n", (unsigned) nodeCount, (unsigned) currentNumaNode());
+}
+
+// a list grows until the hard limit stops it, once it is dropped the memory can be allocated again;
+// the soft limit then has the GC thread release the pooled pages left over to the OS
+void demoHeapLimits(ThreadRuntime *thread) {
+    auto hardLimit = getHeapBytes() + 16 * 1024 * 1024;
+    setHeapLimits(0, hardLimit);
+
+    auto frame = thread->allocator.psUsedHeight;
+    size_t listLength = 0;
+    bool isOutOfMemory = false;
+    try {
+        auto raii = thread->allocator.getRAII(2);
+        auto *node = (Node*) raii.alloc(&NodeType, 0);
+
+        for (; listLength < 10000000; listLength++) {
+            auto *nextNode = (Node*) raii.alloc(&NodeType, 1);
+            setRefField(node, 0, nextNode);
+            node = nextNode;
+        }
+    } catch (const OutOfMemoryError &) {
+        isOutOfMemory = true;
+    }
+
+    CHECK(isOutOfMemory);
+    CHECK(getHeapBytes() <= hardLimit);
+
+    // the whole pointer stack is scanned, the slots of a frame are roots until they are overwritten
+    thread->allocator.pointerStack[frame] = 0;
+    thread->allocator.pointerStack[frame + 1] = 0;
+
+    // as many nodes again, they only fit if the list has been collected
+    try {
+        auto raii = thread->allocator.getRAII(1);
+        for (size_t i = 0; i < listLength; i++) raii.alloc(&NodeType, 0);
+        isOutOfMemory = false;
+    } catch (const OutOfMemoryError &) {}
+
+    CHECK(!isOutOfMemory);
+
+    // garbage enough to leave tens of MB of pages in the pools
+    setHeapLimits(0, 0);
+    {
+        auto raii = thread->allocator.getRAII(1);
+        for (int i = 0; i < 1000000; i++) raii.alloc(&NodeType, 0);
+    }
+    gcST();
+    gcST();
+
+    size_t softLimit = 8 * 1024 * 1024;
+    auto heapBytes = getHeapBytes();
+    CHECK(heapBytes > 2 * softLimit);
+
+    setHeapLimits(softLimit, 0);
+    for (int i = 0; i < 500 && getHeapBytes() > softLimit; i++) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    CHECK(getHeapBytes() <= softLimit);
+
+    setHeapLimits(0, 0);
+    printf("heap limits: out of memory after %zu nodes, %zu bytes scavenged\n", listLength, heapBytes - getHeapBytes());
+}
+
+// the nodes of a list survive, the leaves in between die; the samples should tell them apart, in about
+// the proportions of the bytes allocated
+void demoSampling(ThreadRuntime *thread) {
+    const size_t sampleRateBytes = 4096;
+    setAllocationSampling(sampleRateBytes);
+
+    auto raii = thread->allocator.getRAII(3);
+    auto *head = (Node*) raii.alloc(&NodeType, 0);
+    auto *node = head;
+
+    for (int i = 1; i < 20000; i++) {
+        for (int j = 0; j < 10; j++) raii.alloc(&LeafType, 2);
+
+        auto *nextNode = (Node*) raii.alloc(&NodeType, 1);
+        nextNode->value = i;
+        setRefField(node, 0, nextNode);
+        node = nextNode;
+    }
+    raii.alloc(&NodeType, 2);
+
+    gcST();
+    gcST();
+
+    size_t liveSamples = 0, liveBytes = 0, nodeSamples = 0, survivingSamples = 0;
+    for (auto &sample : getAllocationSamples()) {
+        liveSamples++;
+        liveBytes += sample.bytes;
+        nodeSamples += sample.type == &NodeType;
+        survivingSamples += sample.survivedCollections >= 2;
+    }
+
+    // the leaves are all dead; how many samples are taken is random, but within half and twice the mean here
+    auto expectedNodeSamples = 20000 * sizeof(Node) / sampleRateBytes;
+    auto expectedLeafSamples = 20000 * 10 * LeafType.requiredWords * sizeof(uintptr_t) / sampleRateBytes;
+    CHECK(nodeSamples == liveSamples);
+    CHECK(survivingSamples == liveSamples);
+    CHECK(liveSamples >= expectedNodeSamples / 2 && liveSamples <= expectedNodeSamples * 2);
+
+    // the header of the profile reads "heap profile: <live samples>: <live bytes> [<all samples>: <all bytes>] @ heap_v2/<rate>"
+    std::stringstream profile;
+    dumpAllocationProfile(profile);
+
+    size_t profileLiveSamples = 0, profileLiveBytes = 0, profileSamples = 0, profileBytes = 0, profileRateBytes = 0;
+    auto fields = sscanf(profile.str().c_str(), "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu",
+                         &profileLiveSamples, &profileLiveBytes, &profileSamples, &profileBytes, &profileRateBytes);
+    CHECK(fields == 5);
+    CHECK(profileLiveSamples == liveSamples);
+    CHECK(profileLiveBytes == liveBytes);
+    CHECK(profileRateBytes == sampleRateBytes);
+
+    auto deadSamples = profileSamples - profileLiveSamples;
+    CHECK(deadSamples >= expectedLeafSamples / 2 && deadSamples <= expectedLeafSamples * 2);
+    CHECK(profileBytes - profileLiveBytes == deadSamples * LeafType.requiredWords * sizeof(uintptr_t));
+
+    setAllocationSampling(0);
+    printf("sampling: %zu live samples, %zu dead\n", liveSamples, deadSamples);
+}
+
+// only used by demoCensus, so that the census can be checked to the object
+Type CensusItemType {
+        .requiredWords = 3,
+        .pointersCount = 1,
+        .name = "CensusItem",
+};
+
+// a chain of items amid ten times as many dead ones, counted by a census taken on demand and by the one
+// taken after a collection; the pages being allocated into keep their garbage, which must not be counted either
+void demoCensus(ThreadRuntime *thread) {
+    const size_t itemCount = 5000;
+    const size_t itemBytes = HEAP_ALLOC_HEADER_BYTES + CensusItemType.requiredWords * sizeof(uintptr_t);
+
+    auto raii = thread->allocator.getRAII(3);
+    auto *firstItem = raii.alloc(&CensusItemType, 0);
+    auto *item = firstItem;
+
+    for (size_t i = 1; i < itemCount; i++) {
+        for (int j = 0; j < 10; j++) raii.alloc(&CensusItemType, 2);
+
+        auto *nextItem = raii.alloc(&CensusItemType, 1);
+        setRefField(item, 0, nextItem);
+        item = nextItem;
+    }
+    raii.alloc(&LeafType, 2);
+
+    // the garbage on the page being allocated into is not swept, it must not count a collection later either
+    gcST();
+    gcST();
+
+    auto census = takeHeapCensus();
+    auto *itemCensus = findTypeCensus(census, &CensusItemType);
+    CHECK(itemCensus && itemCensus->liveObjects == itemCount);
+    CHECK(itemCensus && itemCensus->liveBytes == itemCount * itemBytes);
+
+    size_t typesLiveObjects = 0, typesLiveBytes = 0, pagesLiveBytes = 0;
+    for (auto &typeCensus : census.types) {
+        typesLiveObjects += typeCensus.liveObjects;
+        typesLiveBytes += typeCensus.liveBytes;
+    }
+    for (auto &pageCensus : census.pages) pagesLiveBytes += pageCensus.liveWords * sizeof(uintptr_t);
+    CHECK(typesLiveObjects == census.liveObjects);
+    CHECK(typesLiveBytes == census.liveBytes);
+    CHECK(pagesLiveBytes == census.liveBytes);
+    CHECK(census.liveObjects == itemCount + 1);
+
+    std::stringstream json;
+    dumpHeapCensus(census, json);
+    std::stringstream expectedJson;
+    expectedJson << "{\"sweepGeneration\":" << census.sweepGeneration << ",\"liveObjects\":" << census.liveObjects
+                 << ",\"liveBytes\":" << census.liveBytes << ",\"freeBytes\":" << census.freeBytes << ",\"types\":[";
+    CHECK(json.str().starts_with(expectedJson.str()));
+    std::stringstream expectedItemJson;
+    expectedItemJson << "\"name\":\"CensusItem\",\"requiredWords\":3,\"liveObjects\":" << itemCount
+                     << ",\"liveBytes\":" << itemCount * itemBytes << "}";
+    CHECK(json.str().find(expectedItemJson.str()) != std::string::npos);
+
+    setHeapCensusAfterCollection(true);
+    gcST();
+    gcST();
+    setHeapCensusAfterCollection(false);
+
+    // that census leaves out the page being allocated into
+    size_t itemsOnLastPage = 0;
+    for (item = firstItem; item; item = getRefField(item, 0)) {
+        itemsOnLastPage += ((HeapAlloc*) ((uintptr_t) item - HEAP_ALLOC_HEADER_BYTES))->parentPage == thread->allocator.lastPage;
+    }
+
+    auto lastCensus = getLastHeapCensus();
+    itemCensus = findTypeCensus(lastCensus, &CensusItemType);
+    CHECK(lastCensus.sweepGeneration > census.sweepGeneration);
+    CHECK(itemCensus && itemCensus->liveObjects == itemCount - itemsOnLastPage);
+    printf("census: %zu live objects, %zu items after the last collection\n",
+           census.liveObjects, itemCensus ? itemCensus->liveObjects : 0);
+}
+
+void demoWeakReferences(ThreadRuntime *thread) {
+    auto raii = thread->allocator.getRAII(5);
+    WeakMap map;
+
+    auto *held = raii.alloc(&LeafType, 0);
+    auto *dropped = raii.alloc(&LeafType, 1);
+    auto *heldRef = raii.allocWeakRef(held, 2);
+    auto *droppedRef = raii.allocWeakRef(dropped, 3);
+
+    auto *heldValue = (long*) raii.alloc(&LeafType, 4);
+    *heldValue = 42;
+    map.put(held, heldValue);
+    map.put(dropped, held);
+
+    // the slots of dropped and of the value of held are reused, which leaves them unreferenced
+    raii.alloc(&LeafType, 1);
+    raii.alloc(&LeafType, 4);
+
+    gcST();
+    gc();
+
+    CHECK(getWeakRef(heldRef) == held);
+    CHECK(getWeakRef(droppedRef) == nullptr);
+    CHECK(map.get(held) == heldValue);
+    CHECK(*heldValue == 42);
+    CHECK(map.size() == 1);
+    printf("weak references: %zu weak map entries left\n", map.size());
+}
+
+void demoBuffers(ThreadRuntime *thread) {
+    auto raii = thread->allocator.getRAII(2);
+
+    auto *buffer = (char*) raii.allocBuffer(10000, 0);
+    auto bufferBytes = getBufferBytes(buffer);
+    CHECK((uintptr_t) buffer % 4096 == 0);
+    CHECK(bufferBytes >= 10000);
+    buffer[9999] = 'x';
+
+    {
+        BufferPin pin(buffer);
+        raii.allocBuffer(10, 0);
+
+        gcST();
+        gc();
+
+        CHECK(buffer[9999] == 'x');
+
+        // the pin keeps it alive, along with the buffer in the slot
+        auto census = takeHeapCensus();
+        auto *bufferCensus = findTypeCensus(census, &BUFFER_TYPE);
+        CHECK(bufferCensus && bufferCensus->liveObjects == 2);
+    }
+
+    // not pinned anymore, only the buffer in the slot is left
+    gcST();
+    gcST();
+
+    auto census = takeHeapCensus();
+    auto *bufferCensus = findTypeCensus(census, &BUFFER_TYPE);
+    CHECK(bufferCensus && bufferCensus->liveObjects == 1);
+    printf("buffers: %zu bytes at %p\n", bufferBytes, (void*) buffer);
+}
+
+void demoHeapImage(ThreadRuntime *thread) {
+    auto path = (std::filesystem::temp_directory_path() / "hllr_gc_demo.img").string();
+    std::vector<Type*> types {&NodeType, &LeafType};
+
+    {
+        auto raii = thread->allocator.getRAII(3);
+        auto *head = buildList(raii, 10000);
+        auto *payload = (long*) raii.alloc(&LeafType, 2);
+        *payload = 42;
+        setRefField(head, 1, payload);
+        CHECK(saveHeapImage(path.c_str(), {head, nullptr}, types));
+    }
+
+    // the types have to be given as they were saved, a truncated image is refused too
+    CHECK(loadHeapImage(path.c_str(), {&LeafType, &NodeType}) == nullptr);
+
+    auto truncatedPath = path + ".truncated";
+    std::filesystem::copy_file(path, truncatedPath, std::filesystem::copy_options::overwrite_existing);
+    std::filesystem::resize_file(truncatedPath, std::filesystem::file_size(path) / 2);
+    CHECK(loadHeapImage(truncatedPath.c_str(), types) == nullptr);
+    std::filesystem::remove(truncatedPath);
+
+    auto *image = loadHeapImage(path.c_str(), types);
+    std::filesystem::remove(path);
+
+    CHECK(image != nullptr);
+    if (!image) return;
+
+    CHECK(image->roots.size() == 2 && image->roots[1] == nullptr);
+
+    // image objects are never collected, even if only the heap references them
+    {
+        auto raii = thread->allocator.getRAII(1);
+        auto *node = (Node*) raii.alloc(&NodeType, 0);
+        setRefField(node, 0, image->roots[0]);
+
+        gcST();
+        gc();
+
+        CHECK(getRefField(node, 0) == image->roots[0]);
+    }
+
+    auto *head = (Node*) image->roots[0];
+    CHECK(isListIntact(head, 10000));
+    CHECK(getRefField(head, 1) && *(long*) getRefField(head, 1) == 42);
+    printf("heap image: %zu bytes mapped\n", image->mappedBytes);
+}
+
+void demoIncrementalMarking(ThreadRuntime *thread) {
+    setIncrementalMarking(1000, 64 * 1024);
+    auto sweepGeneration = RUNTIME->gc->sweepGeneration;
+    auto heapBytes = getHeapBytes();
+
+    {
+        auto raii = thread->allocator.getRAII(3);
+        auto *head = buildList(raii, 10000);
+
+        // payloads only reachable through the heap, stored while the incremental cycles run
+        for (int round = 0; round < 50; round++) {
+            auto *node = head;
+            while (node) {
+                auto *payload = (long*) raii.alloc(&LeafType, 2);
+                *payload = node->value;
+                setRefField(node, 1, payload);
+                for (int i = 0; i < 10; i++) raii.alloc(&LeafType, 2);
+                node = (Node*) getRefField(node, 0);
+            }
+        }
+
+        CHECK(isListIntact(head, 10000));
+        for (auto *node = head; node; node = (Node*) getRefField(node, 0)) {
+            if (*(long*) getRefField(node, 1) != node->value) {
+                CHECK(!"payload lost");
+                break;
+            }
+        }
+    }
+
+    // the GC thread leaves the collections to the slices, which must have run some and reclaimed most of the leaves
+    auto cycles = (RUNTIME->gc->sweepGeneration - sweepGeneration) / 2;
+    auto leafBytes = 50 * 10000 * 11 * (HEAP_ALLOC_HEADER_BYTES + LeafType.requiredWords * sizeof(uintptr_t));
+    CHECK(cycles >= 5);
+    CHECK(getHeapBytes() < heapBytes + leafBytes / 2);
+
+    setIncrementalMarking(0);
+    printf("incremental marking: %zu cycles, heap holds %zu bytes\n", (size_t) cycles, getHeapBytes());
+}
+
+int main() {
+    ThreadRuntime *thread = initRuntime();
+
+    demoReferences(thread);
+    demoSweep(thread);
+    demoNuma(thread);
+    demoHeapLimits(thread);
+    demoSampling(thread);
+    demoCensus(thread);
+    demoWeakReferences(thread);
+    demoBuffers(thread);
+    demoHeapImage(thread);
+    demoIncrementalMarking(thread);
+
+    shutdownRuntime();
+
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}